@@ -0,0 +1,77 @@
+// Per-call overhead of llua_callf, prepared signatures (llua_sig_call)
+// and batch calls (llua_batch), compared with the equivalent raw Lua API code.
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "llua.h"
+
+const char *code = "return function(a,b,c) return #a + #b + c, c end";
+
+int main (int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 1000000;
+    double raw, callf, sig, batch, chunks;
+    int i1, i2;
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+
+    llua_t *f = llua_eval(L,code,L_VAL);
+    llua_sig_t *fs = llua_sig_new(f,"ssi","ii");
+    llua_t *fc = llua_eval(L,"return function(as,bs,cs) local r = {} "
+        "for i = 1,#cs do r[i] = #as[i] + #bs[i] + cs[i] end return r end",L_VAL);
+    char **as = array_new_ref(char*,n), **bs = array_new_ref(char*,n);
+    int *cs = array_new(int,n), *rs1 = array_new(int,n), *rs2 = array_new(int,n);
+    FOR(i,n) {
+        as[i] = "hello";
+        bs[i] = "dolly";
+        cs[i] = i;
+    }
+
+    BENCH_LOOP(raw,n, {
+        lua_rawgeti(L,LUA_REGISTRYINDEX,f->ref);
+        lua_pushstring(L,"hello");
+        lua_pushstring(L,"dolly");
+        lua_pushinteger(L,i_);
+        lua_pcall(L,3,2,0);
+        i1 = lua_tointeger(L,-2);
+        i2 = lua_tointeger(L,-1);
+        lua_pop(L,2);
+    });
+
+    BENCH_LOOP(callf,n,
+        llua_callf(f,"ssi","hello","dolly",i_,"ii",&i1,&i2)
+    );
+
+    BENCH_LOOP(sig,n,
+        llua_sig_call(fs,"hello","dolly",i_,&i1,&i2)
+    );
+
+    // (each of these does all n rows in one go)
+    BENCH_LOOP(batch,1,
+        unref(llua_batch(f,"ssi","ii",as,bs,cs,rs1,rs2))
+    );
+    batch /= n;
+
+    BENCH_LOOP(chunks,1,
+        unref(llua_batch_chunks(fc,1024,"ssi","i",as,bs,cs,rs1))
+    );
+    chunks /= n;
+
+    printf("%d calls, last result %d %d\n",n,i1,i2);
+    printf("raw lua_pcall   %8.1f ns/call\n",raw);
+    printf("llua_callf      %8.1f ns/call (%+.1f)\n",callf,callf-raw);
+    printf("llua_sig_call   %8.1f ns/call (%+.1f)\n",sig,sig-raw);
+    printf("llua_batch      %8.1f ns/row  (%+.1f)\n",batch,batch-raw);
+    printf("  in chunks     %8.1f ns/row  (%+.1f)\n",chunks,chunks-raw);
+
+    // the strings are static, so these arrays must not free them
+    FOR(i,n)
+        as[i] = bs[i] = NULL;
+    unref(as); unref(bs); unref(cs); unref(rs1); unref(rs2);
+    unref(fc);
+
+    unref(fs);
+    unref(f);
+    lua_close(L);
+    return 0;
+}
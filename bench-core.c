@@ -0,0 +1,198 @@
+// Microbenchmarks of the core llua operations, each next to the equivalent
+// raw Lua API code, written as JSON for tracking regressions. Each case runs
+// in batches; we report the mean ns/op, percentiles of the per-batch ns/op,
+// and the llib objects and Lua allocations per op. `make bench` builds it
+// optimized and runs it.
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "llua.h"
+
+#define SAMPLES 200
+
+static int64 lua_allocs;
+static double samples[SAMPLES];
+static bool first_case = true;
+
+// the usual allocator, counting new blocks and growth
+static void *counting_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    if (nsize == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if (! ptr || nsize > osize)
+        ++lua_allocs;
+    return realloc(ptr,nsize);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, const char *baseline, int nops, int64 objs, int64 lallocs) {
+    double mean = 0;
+    for (int i = 0; i < SAMPLES; i++)
+        mean += samples[i];
+    mean /= SAMPLES;
+    qsort(samples,SAMPLES,sizeof(double),compare_doubles);
+    printf("%s    {\"name\": \"%s\", \"baseline\": ",first_case ? "" : ",\n",name);
+    if (baseline)
+        printf("\"%s\"",baseline);
+    else
+        printf("null");
+    printf(", \"ns_op\": %.2f, \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, "
+        "\"allocs_op\": %.3f, \"lua_allocs_op\": %.3f}",
+        mean,samples[SAMPLES/2],samples[SAMPLES*9/10],samples[SAMPLES*99/100],
+        (double)objs/nops,(double)lallocs/nops);
+    first_case = false;
+}
+
+// time `batch` repetitions of the body SAMPLES times, after a warm-up batch.
+// The loop counter is available as `i_`.
+#define BENCH_CASE(name,baseline,batch,...) { \
+    for (int i_ = 0; i_ < (batch); i_++) { __VA_ARGS__; } \
+    int64 objs_ = obj_created(), lallocs_ = lua_allocs; \
+    for (int s_ = 0; s_ < SAMPLES; s_++) { \
+        double t0_ = bench_now(); \
+        for (int i_ = 0; i_ < (batch); i_++) { __VA_ARGS__; } \
+        samples[s_] = (bench_now() - t0_)/(batch); \
+    } \
+    report(name,baseline,SAMPLES*(batch),obj_created() - objs_,lua_allocs - lallocs_); \
+}
+
+int main (int argc, char **argv)
+{
+    int batch = argc > 1 ? atoi(argv[1]) : 1000;
+    lua_State *L = lua_newstate(counting_alloc,NULL);
+    luaL_openlibs(L);
+    int i1, i2, ival;
+    double x;
+    char *s;
+    double buf[100];
+
+    llua_t *f3 = llua_eval(L,"return function(a,b,c) return #a + #b + c, c end",L_VAL);
+    llua_t *f1 = llua_eval(L,"return function(x) return 2*x end",L_VAL);
+    llua_t *fs = llua_eval(L,"return function(s) return s end",L_VAL);
+    llua_sig_t *sig = llua_sig_new(f3,"ssi","ii");
+    llua_t *T = llua_eval(L,"return {a=42}",L_VAL);
+    llua_t *A = llua_eval(L,"local t = {} for i = 1,100 do t[i] = i + 0.5 end return t",L_VAL);
+
+    printf("{\n  \"lua\": \"%s\",\n  \"batch\": %d,\n  \"samples\": %d,\n  \"results\": [\n",
+        LUA_RELEASE,batch,SAMPLES);
+
+    ///// calls
+    BENCH_CASE("raw_pcall_ssi_ii",NULL,batch, {
+        lua_rawgeti(L,LUA_REGISTRYINDEX,f3->ref);
+        lua_pushstring(L,"hello");
+        lua_pushstring(L,"dolly");
+        lua_pushinteger(L,i_);
+        lua_pcall(L,3,2,0);
+        i1 = lua_tointeger(L,-2);
+        i2 = lua_tointeger(L,-1);
+        lua_pop(L,2);
+    });
+    BENCH_CASE("callf_ssi_ii","raw_pcall_ssi_ii",batch,
+        llua_callf(f3,"ssi","hello","dolly",i_,"ii",&i1,&i2)
+    );
+    BENCH_CASE("sig_call_ssi_ii","raw_pcall_ssi_ii",batch,
+        llua_sig_call(sig,"hello","dolly",i_,&i1,&i2)
+    );
+    BENCH_CASE("raw_pcall_f_f",NULL,batch, {
+        lua_rawgeti(L,LUA_REGISTRYINDEX,f1->ref);
+        lua_pushnumber(L,i_);
+        lua_pcall(L,1,1,0);
+        x = lua_tonumber(L,-1);
+        lua_pop(L,1);
+    });
+    BENCH_CASE("callf_f_f","raw_pcall_f_f",batch,
+        llua_callf(f1,"f",(double)i_,"f",&x)
+    );
+    llua_profile(true);
+    BENCH_CASE("callf_f_f_profiled","callf_f_f",batch,
+        llua_callf(f1,"f",(double)i_,"f",&x)
+    );
+    llua_profile(false);
+    BENCH_CASE("raw_pcall_s_s",NULL,batch, {
+        lua_rawgeti(L,LUA_REGISTRYINDEX,fs->ref);
+        lua_pushstring(L,"hello");
+        lua_pcall(L,1,1,0);
+        i1 = lua_tostring(L,-1)[0];
+        lua_pop(L,1);
+    });
+    BENCH_CASE("callf_s_s","raw_pcall_s_s",batch, {
+        llua_callf(fs,"s","hello","s",&s);
+        unref(s);
+    });
+
+    ///// table access
+    BENCH_CASE("raw_getfield",NULL,batch, {
+        lua_rawgeti(L,LUA_REGISTRYINDEX,T->ref);
+        lua_getfield(L,-1,"a");
+        ival = lua_tointeger(L,-1);
+        lua_pop(L,2);
+    });
+    BENCH_CASE("gets","raw_getfield",batch,
+        unref(llua_gets(T,"a"))
+    );
+    BENCH_CASE("gets_v","raw_getfield",batch,
+        llua_gets_v(T,"a","i",&ival,NULL)
+    );
+
+    ///// array conversion (100 elements)
+    llua_push(A);
+    BENCH_CASE("raw_array_100",NULL,batch/10, {
+        for (int k = 0; k < 100; k++) {
+            lua_rawgeti(L,-1,k+1);
+            buf[k] = lua_tonumber(L,-1);
+            lua_pop(L,1);
+        }
+    });
+    BENCH_CASE("tonumarray_100","raw_array_100",batch/10,
+        unref(llua_tonumarray(L,-1))
+    );
+    BENCH_CASE("toarray_100","raw_array_100",batch/10,
+        unref(llua_toarray(L,-1,'f'))
+    );
+    BENCH_CASE("toarray_buf_100","raw_array_100",batch/10,
+        llua_toarray_buf(L,-1,'f',buf,100,&ival)
+    );
+    lua_pop(L,1);
+
+    ///// references
+    lua_newtable(L);
+    BENCH_CASE("raw_ref_unref",NULL,batch, {
+        lua_pushvalue(L,-1);
+        luaL_unref(L,LUA_REGISTRYINDEX,luaL_ref(L,LUA_REGISTRYINDEX));
+    });
+    BENCH_CASE("new_unref","raw_ref_unref",batch,
+        unref(llua_new(L,-1))
+    );
+    lua_pop(L,1);
+
+    ///// llib objects
+    BENCH_CASE("pool_churn",NULL,batch, {
+        void *P = obj_pool();
+        value_float(i_ + 0.5);
+        value_float(i_ + 1.5);
+        str_new("hello");
+        unref(P);
+    });
+    BENCH_CASE("boxed_float",NULL,batch,
+        unref(value_float(i_ + 0.5))
+    );
+    BENCH_CASE("boxed_int",NULL,batch,
+        unref(value_int(i_))
+    );
+
+    printf("\n  ]\n}\n");
+    (void)buf[0];
+    unref(sig);
+    unref(f3);
+    unref(f1);
+    unref(fs);
+    unref(T);
+    unref(A);
+    lua_close(L);
+    return 0;
+}
@@ -0,0 +1,80 @@
+// Cold start: loading a tree of synthetic scripts with llua_loadfile,
+// compiled from source and then from the bytecode cache (llua_bytecode_cache).
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include "llua.h"
+
+const char *dir = "bench-scripts";
+int nfiles = 300, nfuns = 100;
+
+static void make_scripts() {
+    char path[256];
+    mkdir(dir,0755);
+    snprintf(path,sizeof(path),"%s/cache",dir);
+    mkdir(path,0755);
+    for (int i = 0; i < nfiles; i++) {
+        snprintf(path,sizeof(path),"%s/mod%03d.lua",dir,i);
+        FILE *out = fopen(path,"w");
+        fprintf(out,"local M = {}\n");
+        for (int j = 0; j < nfuns; j++) {
+            fprintf(out,"function M.f%d(t, x)\n",j);
+            fprintf(out,"  local s = 0\n  for i, v in ipairs(t) do\n");
+            fprintf(out,"    if v > x then s = s + v * %d else s = s - i end\n  end\n",j);
+            fprintf(out,"  return s, ('f%d:%%d'):format(s)\nend\n",j);
+        }
+        fprintf(out,"return M\n");
+        fclose(out);
+    }
+}
+
+// time to start a fresh state and load every script, in milliseconds
+static double start_up() {
+    char path[256];
+    double t0 = bench_now();
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+    for (int i = 0; i < nfiles; i++) {
+        snprintf(path,sizeof(path),"%s/mod%03d.lua",dir,i);
+        llua_t *chunk = llua_loadfile(L,path);
+        if (value_is_error(chunk)) {
+            fprintf(stderr,"%s\n",(char*)chunk);
+            exit(1);
+        }
+        unref(chunk);
+    }
+    lua_close(L);
+    return (bench_now() - t0)/1e6;
+}
+
+static double best_of(int n) {
+    double best = start_up();
+    for (int i = 1; i < n; i++) {
+        double t = start_up();
+        if (t < best)
+            best = t;
+    }
+    return best;
+}
+
+int main (int argc, char **argv)
+{
+    char cache[256];
+    if (argc > 1)
+        nfiles = atoi(argv[1]);
+    make_scripts();
+    snprintf(cache,sizeof(cache),"%s/cache",dir);
+
+    double source = best_of(5);
+    llua_bytecode_cache(cache);
+    double cold = start_up(); // compiles and writes the cache
+    double warm = best_of(5);
+    llua_bytecode_cache(NULL);
+
+    printf("%d scripts of %d functions in %s\n",nfiles,nfuns,dir);
+    printf("from source          %8.1f ms\n",source);
+    printf("filling the cache    %8.1f ms\n",cold);
+    printf("from bytecode cache  %8.1f ms (%.1fx)\n",warm,source/warm);
+    return 0;
+}
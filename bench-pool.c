@@ -0,0 +1,55 @@
+// Throughput of a pool of Lua states (llua-pool.c) for 1,2,4.. workers up
+// to the number of cores (or the first argument). Every call does a fixed
+// amount of Lua work, and all calls are queued before any are waited for.
+#define _DEFAULT_SOURCE
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include "llua-pool.h"
+
+#define N_CALLS 4000
+
+static const char *init =
+    "function work(n, s)\n"
+    "  local acc = 0\n"
+    "  for i = 1,n do acc = acc + (i % 7) end\n"
+    "  return #s + acc\n"
+    "end\n";
+
+int main (int argc, char **argv)
+{
+    int max_states = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    llua_future_t **futures = malloc(N_CALLS*sizeof(llua_future_t*));
+    double base = 0;
+
+    printf("%8s %12s %12s %8s\n","states","calls/s","calls/s/state","scaling");
+    for (int ns = 1; ns <= max_states; ns *= 2) {
+        llua_pool_t *P = llua_pool_new(ns,init);
+        if (value_is_error(P)) {
+            fprintf(stderr,"pool: %s\n",(char*)P);
+            return 1;
+        }
+        double t0 = bench_now();
+        FOR(i,N_CALLS) {
+            void **args = array_new_ref(void*,2);
+            args[0] = value_int(10000);
+            args[1] = str_new("hello");
+            futures[i] = llua_pool_call(P,"work",args);
+        }
+        FOR(i,N_CALLS) {
+            double *res = llua_future_wait(futures[i]);
+            assert(! value_is_error(res) && *res == 5 + 29998);
+            unref(futures[i]);
+        }
+        double rate = N_CALLS/((bench_now() - t0)*1e-9);
+        if (ns == 1)
+            base = rate;
+        printf("%8d %12.0f %12.0f %8.2f\n",ns,rate,rate/ns,rate/base);
+        unref(P);
+    }
+    printf("live objects %d\n",obj_kount());
+    free(futures);
+    return 0;
+}
@@ -0,0 +1,62 @@
+// Filling a struct from a table: llua_gets_v against a prepared schema.
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "llua.h"
+
+typedef struct {
+    int id, count;
+    double x, y;
+    bool active;
+    char name[32];
+    llua_buf_t nbuf;
+    double scale;
+} Record;
+
+static llua_field_t record_fields[] = {
+    LLUA_FIELD(Record,id,"i"),
+    LLUA_FIELD(Record,count,"i"),
+    LLUA_FIELD(Record,x,"f"),
+    LLUA_FIELD(Record,y,"f"),
+    LLUA_FIELD(Record,active,"b"),
+    LLUA_FIELD(Record,nbuf,"B"),
+    {"style.scale","f",offsetof(Record,scale)},
+    {NULL}
+};
+
+int main (int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 1000000;
+    double gets_v, fill, write;
+    Record r;
+    r.nbuf = (llua_buf_t)LLUA_BUF(r.name);
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+
+    llua_t *T = llua_eval(L,"return {id=1,count=10,x=1.5,y=2.5,active=true,nbuf='alice',"
+        "style={scale=2}}",L_VAL);
+    llua_schema_t *schema = llua_schema_new(L,record_fields);
+
+    BENCH_LOOP(gets_v,n,
+        llua_gets_v(T,"id","i",&r.id,"count","i",&r.count,"x","f",&r.x,"y","f",&r.y,
+            "active","b",&r.active,"nbuf","B",&r.nbuf,"style.scale","f",&r.scale,NULL)
+    );
+    BENCH_LOOP(fill,n,
+        llua_schema_fill(schema,T,&r)
+    );
+    llua_t *out = llua_newtable(L);
+    BENCH_LOOP(write,n,
+        llua_schema_write(schema,out,&r)
+    );
+
+    printf("%d records of %d fields, name '%s'\n",n,7,r.name);
+    printf("llua_gets_v        %8.1f ns/record\n",gets_v);
+    printf("llua_schema_fill   %8.1f ns/record\n",fill);
+    printf("llua_schema_write  %8.1f ns/record\n",write);
+
+    unref(out);
+    unref(schema);
+    unref(T);
+    lua_close(L);
+    return 0;
+}
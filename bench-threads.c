@@ -0,0 +1,74 @@
+// Multi-threaded stress test of llib objects in a thread-safe build
+// (-DLLIB_THREADS). Each worker owns a lua_State and its own object pools,
+// and all of them share one array of strings. Reports throughput for
+// 1,2,4.. threads up to the number of cores (or the first argument).
+#define _DEFAULT_SOURCE
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "llua.h"
+
+#ifndef LLIB_THREADS
+#error "bench-threads must be built with -DLLIB_THREADS"
+#endif
+
+#define N_ITER 200000
+
+static char **shared;
+
+static void *worker(void *arg) {
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+    llua_t *len = llua_eval(L,"return function(s) return #s end",L_VAL);
+    long total = 0;
+    for (int i = 0; i < N_ITER; i++) {
+        void *P = obj_pool();
+        char **strs = obj_ref(shared);
+        char *s = strs[i % array_len(strs)];
+        int n;
+        llua_callf(len,"s",s,"i",&n);
+        total += n;
+        // some temporaries for the pool to clean up
+        value_float(i + 0.5);
+        str_new(s);
+        unref(strs);
+        unref(P);
+    }
+    unref(len);
+    lua_close(L);
+    *(long*)arg = total;
+    return NULL;
+}
+
+int main (int argc, char **argv)
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t threads[256];
+    long totals[256];
+    double base = 0;
+
+    if (max_threads > 256)
+        max_threads = 256;
+    shared = array_new_ref(char*,16);
+    FOR(i,array_len(shared))
+        shared[i] = str_new("a shared string");
+    obj_share(shared);
+
+    printf("%8s %12s %12s %8s\n","threads","ops/s","ops/s/thread","scaling");
+    for (int nt = 1; nt <= max_threads; nt *= 2) {
+        double t0 = bench_now();
+        FOR(i,nt)
+            pthread_create(&threads[i],NULL,worker,&totals[i]);
+        FOR(i,nt)
+            pthread_join(threads[i],NULL);
+        double rate = nt*(double)N_ITER/((bench_now() - t0)*1e-9);
+        if (nt == 1)
+            base = rate;
+        printf("%8d %12.0f %12.0f %8.2f\n",nt,rate,rate/nt,rate/base);
+    }
+    printf("shared refcount %d, live objects %d\n",obj_refcount(shared),obj_kount());
+    unref(shared);
+    return 0;
+}
@@ -0,0 +1,44 @@
+// Throughput of converting a large Lua array into C arrays:
+// the element-by-element llua_tonumarray against llua_toarray_buf for each kind.
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "llua.h"
+
+int main (int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 1000000, reps = 10, len;
+    double ns;
+    const char *kinds = "flgiub";
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+
+    lua_newtable(L);
+    for (int i = 0; i < n; i++) {
+        lua_pushinteger(L,i % 256);
+        lua_rawseti(L,-2,i+1);
+    }
+    lua_newtable(L);
+    for (int i = 0; i < n; i++) {
+        lua_pushboolean(L,i & 1);
+        lua_rawseti(L,-2,i+1);
+    }
+    // numbers at -2, booleans at -1
+    void *buf = malloc(n*sizeof(double));
+
+    printf("%d elements\n",n);
+    BENCH_LOOP(ns,reps, unref(llua_tonumarray(L,-2)) );
+    printf("llua_tonumarray   %6.2f ns/element\n",ns/n);
+    for (const char *k = kinds; *k; k++) {
+        err_t err = NULL;
+        BENCH_LOOP(ns,reps, err = llua_toarray_buf(L,*k == 'b' ? -1 : -2,*k,buf,n,&len) );
+        if (err) {
+            fprintf(stderr,"%c: %s\n",*k,err);
+            return 1;
+        }
+        printf("llua_toarray '%c'  %6.2f ns/element\n",*k,ns/n);
+    }
+    free(buf);
+    lua_close(L);
+    return 0;
+}
@@ -0,0 +1,21 @@
+// timing support for the benchmark programs
+#ifndef BENCH_H
+#define BENCH_H
+#define _POSIX_C_SOURCE 199309L
+#include <time.h>
+
+// monotonic time in nanoseconds
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+// time `n` repetitions of the body, giving nanoseconds per repetition in `ns`.
+// The loop counter is available as `i_`.
+#define BENCH_LOOP(ns,n,...) { \
+    double t0_ = bench_now(); \
+    for (int i_ = 0; i_ < (n); i_++) { __VA_ARGS__; } \
+    ns = (bench_now() - t0_)/(n); \
+}
+#endif
@@ -79,28 +79,25 @@ static void remove_our_ptr(void *p) {
 static void *low_ptr, *high_ptr;
 
 static void add_our_ptr(void *p) {
-    if (! low_ptr) {
-        low_ptr = p;
-        high_ptr = p;
-    } else {
-        if (p < low_ptr)
-            low_ptr = p;
-        else if (p > high_ptr)
-            high_ptr = p;
-    }
-    ++kount;
+    // (these loops only go around again if another thread got in first)
+    void *lo = OBJ_ATOMIC_LOAD(low_ptr), *hi = OBJ_ATOMIC_LOAD(high_ptr);
+    while ((! lo || p < lo) && ! OBJ_ATOMIC_CAS(low_ptr,lo,p))
+        ;
+    while (p > hi && ! OBJ_ATOMIC_CAS(high_ptr,hi,p))
+        ;
+    OBJ_ATOMIC_ADD(kount,1);
 }
 
 static int our_ptr (void *p) {
-    return p >= low_ptr && p <= high_ptr;
+    return p >= OBJ_ATOMIC_LOAD(low_ptr) && p <= OBJ_ATOMIC_LOAD(high_ptr);
 }
 
 static void remove_our_ptr(void *p) {
-    --kount;
+    OBJ_ATOMIC_ADD(kount,-1);
 }
 #endif
 
-int obj_kount() { return kount; }
+int obj_kount() { return OBJ_ATOMIC_LOAD(kount); }
 
 static void s_free(void *p, void *obj) {
     free(obj);
@@ -114,18 +111,31 @@ ObjAllocator obj_default_allocator = {
   s_alloc, s_free, NULL
 };
 
+// set while an arena pool is the innermost pool (see pool.c)
+LLIB_TLS ObjAllocator *_pool_arena;
+
+static ObjTypeCounts *type_counts(int idx);
+
 static ObjHeader *new_obj(int size, ObjType *t) {
     size += sizeof(ObjHeader);
     void *obj;
+    bool arena = _pool_arena != NULL;
 
-    if (! t->alloc) {
+    if (arena) {
+        obj = _pool_arena->alloc(_pool_arena,size);
+    } else if (! t->alloc) {
         obj = malloc(size);
     } else {
         obj = t->alloc->alloc(t->alloc,size);
     }
+    ((ObjHeader*)obj)->is_shared = 0;
+    ((ObjHeader*)obj)->is_arena = arena;
     add_our_ptr(obj);
+    ObjTypeCounts *tc = type_counts(t->idx);
+    OBJ_LOCAL_ADD(tc->created,1);
+    OBJ_LOCAL_ADD(tc->bytes,size);
 #ifdef DEBUG
-    ++t->instances;
+    OBJ_ATOMIC_ADD(t->instances,1);
 #endif
     return (ObjHeader *)obj;
 }
@@ -152,41 +162,243 @@ int obj_refcount (const void *p)
 ObjType obj_types[LLIB_TYPE_MAX];
 const ObjType *obj_types_ptr = obj_types;
 
-int obj_types_size = 8;
+int obj_types_size = OBJ_RESERVED_TYPES;
 
 typedef ObjType *OTP;
 
-OTP obj_type_(ObjHeader *h) {
-    return &obj_types[h->type];
+static void initialize_types();
+
+// Counters which cost a plain add even in thread-safe builds are kept in
+// a block per thread, and added up when read. A thread's blocks keep their
+// counts after it exits, since they still count, and are taken over by the
+// next new thread; so there are only as many blocks as threads alive at once.
+
+#ifdef LLIB_THREADS
+#include <pthread.h>
+
+static pthread_key_t counters_key;
+static pthread_once_t counters_once = PTHREAD_ONCE_INIT;
+static LLIB_TLS ObjCounterBlock *my_blocks;
+
+// the thread is exiting, so its blocks are free for other threads
+static void release_blocks(void *p) {
+    ObjCounterBlock *b = (ObjCounterBlock*)p, *next;
+    my_blocks = NULL;
+    for (; b; b = next) {
+        next = b->owned;
+        *b->slot = NULL;
+        OBJ_ATOMIC_STORE(b->in_use,0);
+    }
 }
 
-OTP type_from_dtor(const char *name, DisposeFn dtor) {
-    if (dtor) {
-        for(OTP pt = obj_types; pt->name; ++pt) {
-            if (pt->dtor == dtor)
-                return pt;
+static void make_counters_key() {
+    pthread_key_create(&counters_key,release_blocks);
+}
+#endif
+
+/// a block of counters for this thread.
+// The block is `size` bytes, starting with an `ObjCounterBlock`, and is on
+// `list` (readers follow `next`). `slot` is the thread-local pointer to it,
+// which is cleared when the thread exits.
+ObjCounterBlock *obj_counter_block(ObjCounterBlock **list, int size, ObjCounterBlock **slot) {
+    ObjCounterBlock *b;
+    for (b = OBJ_ATOMIC_LOAD(*list); b; b = b->next) {
+        int idle = 0;
+        if (OBJ_ATOMIC_LOAD(b->in_use) == 0 && OBJ_ATOMIC_CAS(b->in_use,idle,1))
+            break;
+    }
+    if (! b) {
+        b = calloc(1,size);
+        b->in_use = 1;
+        b->next = OBJ_ATOMIC_LOAD(*list);
+        while (! OBJ_ATOMIC_CAS(*list,b->next,b))
+            ;
+    }
+    b->slot = slot;
+    *slot = b;
+#ifdef LLIB_THREADS
+    pthread_once(&counters_once,make_counters_key);
+    b->owned = my_blocks;
+    my_blocks = b;
+    pthread_setspecific(counters_key,b);
+#endif
+    return b;
+}
+
+// Types are counted in chunks, which are made as they are needed.
+#define TYPE_CHUNK 64
+
+typedef struct ObjCounts_ {
+    ObjCounterBlock hdr;
+    ObjTypeCounts *types[LLIB_TYPE_MAX/TYPE_CHUNK];
+} ObjCounts;
+
+static ObjCounterBlock *all_counts;
+static LLIB_TLS ObjCounterBlock *my_counts;
+
+static ObjTypeCounts *type_counts(int idx) {
+    ObjCounts *c = (ObjCounts*)my_counts;
+    if (! c)
+        c = (ObjCounts*)obj_counter_block(&all_counts,sizeof(ObjCounts),&my_counts);
+    ObjTypeCounts *chunk = c->types[idx/TYPE_CHUNK];
+    if (! chunk) {
+        chunk = calloc(TYPE_CHUNK,sizeof(ObjTypeCounts));
+        OBJ_ATOMIC_STORE(c->types[idx/TYPE_CHUNK],chunk);
+    }
+    return &chunk[idx % TYPE_CHUNK];
+}
+
+/// objects of a type created and freed, and bytes allocated for it, in all threads.
+// The bytes include the object headers, and frees are not subtracted.
+void obj_type_counts(int idx, ObjTypeCounts *tc) {
+    tc->created = tc->freed = tc->bytes = 0;
+    for (ObjCounts *c = (ObjCounts*)OBJ_ATOMIC_LOAD(all_counts); c; c = (ObjCounts*)c->hdr.next) {
+        ObjTypeCounts *chunk = OBJ_ATOMIC_LOAD(c->types[idx/TYPE_CHUNK]);
+        if (chunk) {
+            tc->created += OBJ_ATOMIC_LOAD(chunk[idx % TYPE_CHUNK].created);
+            tc->freed += OBJ_ATOMIC_LOAD(chunk[idx % TYPE_CHUNK].freed);
+            tc->bytes += OBJ_ATOMIC_LOAD(chunk[idx % TYPE_CHUNK].bytes);
         }
-    } else { // no dispose fun, so let's match by name
-        for(OTP pt = obj_types; pt->name; ++pt) {
-            if (strcmp(pt->name,name) == 0)
-                return pt;
+    }
+}
+
+/// number of objects ever created, in all threads.
+int64 obj_created() {
+    int64 res = 0;
+    for (ObjCounts *c = (ObjCounts*)OBJ_ATOMIC_LOAD(all_counts); c; c = (ObjCounts*)c->hdr.next) {
+        for (int i = 0; i < LLIB_TYPE_MAX/TYPE_CHUNK; i++) {
+            ObjTypeCounts *chunk = OBJ_ATOMIC_LOAD(c->types[i]);
+            if (chunk)
+                for (int k = 0; k < TYPE_CHUNK; k++)
+                    res += OBJ_ATOMIC_LOAD(chunk[k].created);
         }
     }
-    return NULL;
+    return res;
+}
+
+OTP obj_type_(ObjHeader *h) {
+    return &obj_types[h->type];
+}
+
+/// type descriptor by slot index, e.g. `OBJ_DOUBLE_T`.
+// Can be used to set a custom allocator for a type; this must happen
+// before any objects of that type are created.
+ObjType *obj_type_at(int idx) {
+    initialize_types();
+    return &obj_types[idx];
+}
+
+/// number of type slots in use; see `obj_type_at`.
+int obj_type_count() {
+    initialize_types();
+    return OBJ_ATOMIC_LOAD(obj_types_size);
+}
+
+// Types are found by hashing, either on their dispose function or on their
+// name, so the cost of looking up a type does not depend on how many types
+// there are. The hash tables are open-addressed and hold type index + 1.
+// A type is filled in before it is published in the tables, and entries
+// never change once set, so lookups need no locking.
+#define TYPE_HASH_SIZE (2*LLIB_TYPE_MAX)
+#define TYPE_HASH_MASK (TYPE_HASH_SIZE-1)
+
+static uint16 types_by_dtor[TYPE_HASH_SIZE];
+static uint16 types_by_name[TYPE_HASH_SIZE];
+
+static uint32 hash_ptr(const void *p) {
+    uint32 h = (uint32)((size_t)p >> 3);
+    return h * 2654435761u;
+}
+
+static uint32 hash_str(const char *s) {
+    uint32 h = 2166136261u;
+    for (; *s; ++s)
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    return h;
+}
+
+static OTP lookup_by_dtor(DisposeFn dtor) {
+    for (uint32 i = hash_ptr((void*)dtor);; ++i) {
+        int idx = OBJ_ATOMIC_LOAD(types_by_dtor[i & TYPE_HASH_MASK]);
+        if (idx == 0)
+            return NULL;
+        OTP pt = &obj_types[idx-1];
+        if (pt->dtor == dtor)
+            return pt;
+    }
+}
+
+static OTP lookup_by_name(const char *name) {
+    for (uint32 i = hash_str(name);; ++i) {
+        int idx = OBJ_ATOMIC_LOAD(types_by_name[i & TYPE_HASH_MASK]);
+        if (idx == 0)
+            return NULL;
+        OTP pt = &obj_types[idx-1];
+        // usually the very same string literal
+        if (pt->name == name || strcmp(pt->name,name) == 0)
+            return pt;
+    }
+}
+
+// publish a type in a hash table. If a type with the same key is
+// already there (maybe just put there by another thread) then that wins.
+static OTP hash_insert(uint16 *table, uint32 i, OTP t, bool by_dtor) {
+    for (;; ++i) {
+        uint16 *slot = &table[i & TYPE_HASH_MASK];
+        uint16 idx = OBJ_ATOMIC_LOAD(*slot);
+        if (idx == 0 && OBJ_ATOMIC_CAS(*slot,idx,t->idx+1))
+            return t;
+        OTP pt = &obj_types[idx-1];
+        if (by_dtor ? pt->dtor == t->dtor : strcmp(pt->name,t->name) == 0)
+            return pt;
+    }
+}
+
+// a type is known by its name; if it has a dispose function, then
+// it is matched by that when creating objects.
+static OTP register_type(OTP t) {
+    OTP res = hash_insert(types_by_name,hash_str(t->name),t,false);
+    if (t->dtor)
+        res = hash_insert(types_by_dtor,hash_ptr((void*)t->dtor),t,true);
+    return res;
+}
+
+OTP type_from_dtor(const char *name, DisposeFn dtor) {
+    if (dtor)
+        return lookup_by_dtor(dtor);
+    else // no dispose fun, so let's match by name
+        return lookup_by_name(name);
 }
 
 OTP obj_new_type(int size, const char *type, DisposeFn dtor) {
-    OTP t = &obj_types[obj_types_size];
+    initialize_types();
+    int idx = OBJ_ATOMIC_ADD(obj_types_size,1) - 1;
+    assert(idx < LLIB_TYPE_MAX);
+    OTP t = &obj_types[idx];
     t->name = type;
     t->dtor = dtor;
     t->mlem = size;
-    t->idx = obj_types_size++;
-    // just in case...
-    obj_types[obj_types_size].name = NULL;
+    t->idx = idx;
+    // another thread may have registered the same type meanwhile,
+    // in which case this slot is simply never used.
+    return register_type(t);
+}
+
+/// fill in one of the reserved fixed type slots.
+// Such types can be checked with a constant slot index, e.g.
+// `obj_type_index(P) == OBJ_LLUA_T`.
+ObjType *obj_reserved_type(int idx, int size, DisposeFn dtor) {
+    initialize_types();
+    OTP t = &obj_types[idx];
+    if (t->dtor != dtor) {
+        t->dtor = dtor;
+        t->mlem = size;
+        register_type(t);
+    }
     return t;
 }
 
-DisposeFn _pool_filter, _pool_cleaner;
+LLIB_TLS DisposeFn _pool_filter, _pool_cleaner;
 
 static void *pin_ (ObjHeader *h) {
     void *obj = PTR_FROM_HEADER(h);
@@ -196,7 +408,7 @@ static void *pin_ (ObjHeader *h) {
 }
 
 // the type system needs to associate certain common types with fixed slots
-static bool initialized = false;
+static int initialized = 0; // 1 while initializing, 2 when done
 
 static ObjType obj_types_initialized[] = {
     {"char",NULL,NULL,1,0},
@@ -206,12 +418,33 @@ static ObjType obj_types_initialized[] = {
     {"double",NULL,NULL,sizeof(double),4},
     {"float",NULL,NULL,sizeof(float),5},
     {"bool",NULL,NULL,sizeof(bool),6},
-    {"MapKeyValue",NULL,NULL,sizeof(MapKeyValue),7}
+    {"MapKeyValue",NULL,NULL,sizeof(MapKeyValue),7},
+    {"llua_t",NULL,NULL,0,8}
 };
 
 static void initialize_types() {
-    initialized = true;
-    memcpy(obj_types,obj_types_initialized,sizeof(obj_types_initialized));
+    int state = OBJ_ATOMIC_LOAD(initialized);
+    if (state == 2)
+        return;
+    if (state == 0 && OBJ_ATOMIC_CAS(initialized,state,1)) {
+        memcpy(obj_types,obj_types_initialized,sizeof(obj_types_initialized));
+        FOR(i,OBJ_RESERVED_TYPES)
+            register_type(&obj_types[i]);
+        OBJ_ATOMIC_STORE(initialized,2);
+    } else { // another thread is doing it
+        while (OBJ_ATOMIC_LOAD(initialized) != 2)
+            ;
+    }
+}
+
+static void *obj_new_of_(int size, OTP t) {
+    ObjHeader *h = new_obj(size,t);
+    h->_len = 0;
+    h->_ref = 1;
+    h->is_array = 0;
+    h->is_ref_container = 0;
+    h->type = t->idx;
+    return pin_(h);
 }
 
 /// allocate a new refcounted object.
@@ -221,20 +454,20 @@ static void initialize_types() {
 // @function obj_new
 
 void *obj_new_(int size, const char *type, DisposeFn dtor) {
-    if (! initialized) {
-        initialize_types();
-    }
+    initialize_types();
     OTP t = type_from_dtor(type,dtor);
     if (! t)
         t = obj_new_type(size,type,dtor);
+    return obj_new_of_(size,t);
+}
 
-    ObjHeader *h = new_obj(size,t);
-    h->_len = 0;
-    h->_ref = 1;
-    h->is_array = 0;
-    h->is_ref_container = 0;
-    h->type = t->idx;
-    return pin_(h);
+/// allocate a new refcounted object of a known type.
+// This skips looking up the type.
+// @tparam ObjType* t
+// @treturn T*
+// @function obj_new_from_type
+void *obj_new_from_type(ObjType *t) {
+    return obj_new_of_(t->mlem,t);
 }
 
 // getting element size is now a little more indirect...
@@ -250,7 +483,9 @@ int obj_elem_size(void *P) {
 bool obj_is_instance(const void *P, const char *name) {
     if (obj_refcount(P) == -1)
         return false;
-    return strcmp(obj_type(P)->name,name) == 0;
+    // (any type of that name, since types with different dispose functions may share one)
+    const char *tname = obj_type(P)->name;
+    return tname == name || strcmp(tname,name) == 0;
 }
 
 // Ref counted objects are either arrays or structs.
@@ -272,17 +507,21 @@ static void obj_free_(ObjHeader *h, const void *P) {
     }
 
     remove_our_ptr(h);
+    OBJ_LOCAL_ADD(type_counts(h->type)->freed,1);
 
 #ifdef DEBUG
-    --t->instances;
+    OBJ_ATOMIC_ADD(t->instances,-1);
 #endif
 
     // if the object pool is active, then remove our pointer from it!
     if (_pool_cleaner)
         _pool_cleaner((void *)P);
 
-    // the object's type might have a custom allocator
-    if (t->alloc) {
+    // arena objects go when their arena goes;
+    // otherwise the object's type might have a custom allocator
+    if (h->is_arena) {
+        return;
+    } else if (t->alloc) {
         t->alloc->free(t->alloc,h);
     } else {
         free(h);
@@ -298,6 +537,14 @@ static void obj_free_(ObjHeader *h, const void *P) {
 
 void obj_incr_(const void *P) {
     ObjHeader *h = obj_header_(P);
+#ifdef LLIB_THREADS
+    if (h->is_shared) { // (shared objects are never immortal)
+        __atomic_add_fetch(&h->_ref,1,__ATOMIC_RELAXED);
+        return;
+    }
+#endif
+    if (h->_ref == OBJ_IMMORTAL)
+        return;
     ++(h->_ref);
 }
 
@@ -310,11 +557,99 @@ void obj_unref(const void *P) {
 #ifdef DEBUG
     assert(our_ptr(h));
 #endif
+#ifdef LLIB_THREADS
+    if (h->is_shared) {
+        if (__atomic_sub_fetch(&h->_ref,1,__ATOMIC_ACQ_REL) == 0)
+            obj_free_(h,P);
+        return;
+    }
+#endif
+    if (h->_ref == OBJ_IMMORTAL)
+        return;
     --(h->_ref);
     if (h->_ref == 0)
         obj_free_(h,P);
 }
 
+/// make an object live forever.
+// `ref` and `unref` leave it alone, so it can be freely shared,
+// e.g. as a cached boxed value. It no longer counts as a live object.
+// An object from an arena is first copied out with `obj_keep`, so always
+// use the returned pointer.
+void *obj_immortal(void *P) {
+    ObjHeader *h = obj_header_(P);
+    if (h->is_arena) {
+        P = obj_keep(P);
+        h = obj_header_(P);
+    }
+    if (h->_ref != OBJ_IMMORTAL) {
+        h->_ref = OBJ_IMMORTAL;
+        OBJ_ATOMIC_ADD(kount,-1);
+    }
+    return P;
+}
+
+/// keep an object beyond the pool it was created in.
+// For ordinary objects this is just `ref`. Objects allocated from an arena
+// (see `obj_pool_arena`) go when the arena goes, so they are copied out,
+// together with any arena elements of reference arrays. The copy has
+// one reference; the arena original is left behind as an inert object.
+// Only the object itself is copied, so objects which own other objects
+// through plain pointers (like sequences) should be kept out of arenas.
+void *obj_keep(void *P) {
+    ObjHeader *h = obj_header_(P);
+    if (! h->is_arena)
+        return obj_ref(P);
+    OTP t = obj_type_(h);
+    int size = h->is_array ? t->mlem*(h->_len+1) : t->mlem;
+    ObjAllocator *arena = _pool_arena;
+    _pool_arena = NULL;
+    ObjHeader *nh = new_obj(size,t);
+    _pool_arena = arena;
+    memcpy(nh,h,sizeof(ObjHeader) + size);
+    nh->is_arena = 0;
+    nh->_ref = 1;
+    void *NP = PTR_FROM_HEADER(nh);
+    if (h->is_array && h->is_ref_container) {
+        // the copy takes over the references of the original
+        void **arr = (void**)NP;
+        for (int i = 0, n = h->_len; i < n; i++) {
+            if (arr[i] && obj_header_(arr[i])->is_arena)
+                arr[i] = obj_keep(arr[i]);
+        }
+    }
+    // the original is no longer the business of its pool
+    if (_pool_cleaner)
+        _pool_cleaner(P);
+    h->_ref = OBJ_IMMORTAL;
+    remove_our_ptr(h);
+    OBJ_LOCAL_ADD(type_counts(h->type)->freed,1);
+    return NP;
+}
+
+/// mark an object as shared between threads.
+// In thread-safe builds (`LLIB_THREADS`) its refcount is then updated
+// atomically. The elements of reference arrays are shared as well.
+// Since the last reference may now be dropped by any thread, the
+// object is taken out of this thread's object pools; the caller
+// owns the reference that the pool had.
+void *obj_share(void *P) {
+    ObjHeader *h = obj_header_(P);
+    if (h->is_shared || h->_ref == OBJ_IMMORTAL)
+        return P;
+    h->is_shared = 1;
+    if (_pool_cleaner)
+        _pool_cleaner(P);
+    if (h->is_array && h->is_ref_container) {
+        void **arr = (void**)P;
+        for (int i = 0, n = h->_len; i < n; i++) {
+            if (arr[i])
+                obj_share(arr[i]);
+        }
+    }
+    return P;
+}
+
 void obj_apply_v_varargs(void *o, PFun fn,va_list ap) {
     void *P;
     while ((P = va_arg(ap,void*)) != NULL)  {
@@ -406,9 +741,7 @@ typedef unsigned char byte;
 //? allocates len+1 - ok?
 
 void *array_new_(int mlen, const char *name, int len, int isref) {
-    if (! initialized) {
-        initialize_types();
-    }
+    initialize_types();
 
     OTP t = type_from_dtor(name,NULL);
     if (! t)
@@ -481,7 +814,8 @@ void * array_resize(void *P, int newsz) {
     OTP t = obj_type_(pr);
     int mlen = t->mlem;
     void *newp = array_new_(mlen,t->name,newsz,pr->is_ref_container);
-    memcpy(newp,P,mlen*pr->_len);
+    // (when shrinking, only copy what fits)
+    memcpy(newp,P,mlen*(newsz < pr->_len ? newsz : pr->_len));
     // if old ref array is going to die, make sure it doesn't dispose our elements
     pr->is_ref_container = 0;
     obj_unref(P);
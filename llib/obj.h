@@ -25,14 +25,73 @@ typedef struct ObjAllocator_ {
     void *data;
 } ObjAllocator;
 
+typedef struct ObjSlabStats_ {
+    int64 allocs;    // small allocations
+    int64 hits;      // ...served from a free list
+    int64 frees;
+    int64 large;     // allocations too large for the slab, passed to malloc
+    int64 blocks;
+    int64 reserved;  // bytes in blocks
+    int64 in_use;    // bytes in live chunks
+    int64 wasted;    // total bytes lost to rounding up to the size class
+    double hit_rate;
+    double fragmentation;
+} ObjSlabStats;
+
+// objects of a type created and freed, and the bytes allocated for them
+// (with headers); see `obj_type_counts`
+typedef struct ObjTypeCounts_ {
+    int64 created, freed;
+    int64 bytes;
+} ObjTypeCounts;
+
+// the start of a thread's block of counters; see `obj_counter_block`
+typedef struct ObjCounterBlock_ {
+    struct ObjCounterBlock_ *next;   // all the blocks
+    struct ObjCounterBlock_ *owned;  // other blocks of the owning thread
+    struct ObjCounterBlock_ **slot;  // where the owning thread keeps it
+    int in_use;
+} ObjCounterBlock;
+
+// The refcount is a plain field (not a bitfield) so that it can be
+// updated atomically for objects shared between threads.
 typedef struct ObjHeader_ {
-    unsigned int type:14;
+    unsigned int type:12;
     unsigned int is_array:1;
     unsigned int is_ref_container:1;
-    unsigned int _ref:16;
-    unsigned int _len:32;
+    unsigned int is_shared:1;
+    unsigned int is_arena:1;
+    uint16 _ref;
+    uint32 _len;
 } ObjHeader;
 
+// Thread-safe builds (LLIB_THREADS) keep the object pools per-thread and
+// use atomic operations for the shared counters and the type registry.
+// Refcounts are only atomic for objects marked with `obj_share`.
+#ifdef LLIB_THREADS
+#ifdef _MSC_VER
+#error "LLIB_THREADS needs GCC-compatible __atomic builtins"
+#endif
+#ifdef LLIB_PTR_LIST
+#error "LLIB_PTR_LIST is not thread-safe"
+#endif
+#define LLIB_TLS __thread
+#define OBJ_ATOMIC_ADD(var,n) __atomic_add_fetch(&(var),(n),__ATOMIC_RELAXED)
+#define OBJ_ATOMIC_LOAD(var) __atomic_load_n(&(var),__ATOMIC_ACQUIRE)
+#define OBJ_ATOMIC_STORE(var,val) __atomic_store_n(&(var),(val),__ATOMIC_RELEASE)
+#define OBJ_ATOMIC_CAS(var,expected,desired) \
+    __atomic_compare_exchange_n(&(var),&(expected),(desired),false,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)
+// for counters which only their own thread writes, but any thread may read
+#define OBJ_LOCAL_ADD(var,n) __atomic_store_n(&(var),(var) + (n),__ATOMIC_RELAXED)
+#else
+#define LLIB_TLS
+#define OBJ_ATOMIC_ADD(var,n) ((var) += (n))
+#define OBJ_ATOMIC_LOAD(var) (var)
+#define OBJ_ATOMIC_STORE(var,val) ((var) = (val))
+#define OBJ_ATOMIC_CAS(var,expected,desired) ((var) == (expected) ? ((var) = (desired), true) : ((expected) = (var), false))
+#define OBJ_LOCAL_ADD(var,n) ((var) += (n))
+#endif
+
 typedef struct ObjType_ {
     const char *name;
     DisposeFn dtor;
@@ -52,7 +111,9 @@ enum {
     OBJ_DOUBLE_T = 4,
     OBJ_FLOAT_T = 5,
     OBJ_BOOL_T = 6,
-    OBJ_KEYVALUE_T = 7
+    OBJ_KEYVALUE_T = 7,
+    OBJ_LLUA_T = 8,  // reserved for llua references
+    OBJ_RESERVED_TYPES = 9
 };
 
 typedef struct {
@@ -97,7 +158,8 @@ typedef int intptr;
 #define scoped obj_scoped
 #endif
 
-#define obj_pool_count(P) (array_len(**((void****)P) ))
+// refcount of objects which are never freed (see `obj_immortal`)
+#define OBJ_IMMORTAL 0xFFFF
 
 #ifdef DEBUG
 void obj_dump_types(bool all);
@@ -108,14 +170,31 @@ void obj_dump_pointers();
 void obj_dump_all();
 #endif
 int obj_kount();
+int64 obj_created();
 void *obj_pool();
+void *obj_pool_arena();
+int obj_pool_count(void *P);
+int obj_pool_depth();
+void *obj_keep(void *P);
+void obj_pool_suspend();
+void obj_pool_resume();
 ObjType *obj_type_(ObjHeader *h);
 ObjType *obj_new_type(int size, const char *type, DisposeFn dtor);
+ObjType *obj_reserved_type(int idx, int size, DisposeFn dtor);
+ObjType *obj_type_at(int idx);
+int obj_type_count();
+void obj_type_counts(int idx, ObjTypeCounts *tc);
+ObjCounterBlock *obj_counter_block(ObjCounterBlock **list, int size, ObjCounterBlock **slot);
+ObjAllocator *obj_slab_allocator();
+void obj_slab_stats(ObjSlabStats *st);
 int obj_elem_size(void *P);
 void *obj_new_(int size, const char *type,DisposeFn dtor);
+void *obj_new_from_type(ObjType *t);
 bool obj_is_instance(const void *P, const char *name);
 void obj_incr_(const void *P);
 void obj_unref(const void *P);
+void *obj_immortal(void *P);
+void *obj_share(void *P);
 void obj_apply_varargs(void *o, PFun fn,...);
 void __auto_unref(void *p) ;
 
@@ -4,90 +4,286 @@
 * Copyright Steve Donovan, 2013
 */
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
 #include "obj.h"
 
 ////// Object Pool Support //////
-// An object pool is a ref seq containing all objects generated since the pool
-// was created.  The actual pool object is a ref to that seq, so that disposing
-// of it will drain the pool.
+// An object pool contains all objects generated since the pool
+// was created.  The actual pool object is a marker which refers to the pool,
+// so that disposing of it will drain the pool.
 //
 // As objects are explicitly unref'd, they're taken out of the pool by setting
 // their entry to NULL.  So when we finally drain the pool, it only contains
 // genuine alive orphan objects.
 //
+// Each pool keeps a hash index from object to entry, so taking an object out
+// is constant time. The pool is only compacted when it runs out of room and at
+// least half of its entries are dead, so it stays proportional to the number
+// of live objects even in long scopes.
 //
+// The pools themselves use plain malloc, so that they don't end up
+// tracking their own storage.
+//
+// An arena pool also owns an arena: while it is the innermost pool, all
+// objects are bump-allocated from large blocks, which are released in one
+// go when the pool is disposed (after any survivors have been unref'd).
+// `obj_keep` copies objects out of the arena.
+//
+// While pools are suspended, new objects go into no pool or arena. This is
+// for objects kept by the library itself (caches, immortal values), and
+// for the parts of objects which own other objects: otherwise a pool would
+// release the parts of an object which had been kept.
+
+// (each thread has its own stack of pools)
+extern LLIB_TLS DisposeFn _pool_filter, _pool_cleaner;
+extern LLIB_TLS ObjAllocator *_pool_arena;
+
+typedef struct ArenaBlock_ {
+    struct ArenaBlock_ *next;
+    int size, used;
+} ArenaBlock;
+
+// the allocator comes first, so an Arena* is an ObjAllocator*
+typedef struct Arena_ {
+    ObjAllocator alloc;
+    ArenaBlock *blocks;
+} Arena;
 
-extern DisposeFn _pool_filter, _pool_cleaner;
+typedef struct Pool_ {
+    void **objs;  // objects in order of creation, NULL if since freed
+    int n, cap, live;
+    int *index;   // open-addressed: entry+1, 0 for empty, -1 for removed
+    int mask;
+    bool draining;
+    Arena *arena;
+} Pool;
 
-typedef void* ObjPool;
+typedef Pool *ObjPool;
 
-typedef void*** VoidSeq;
+#define POOL_INITIAL_CAP 16
+#define POOL_REMOVED -1
+#define ARENA_BLOCK_SIZE 0x10000
+#define ARENA_ALIGN(n) (((n) + 15) & ~15)
+#define ARENA_DATA ARENA_ALIGN((int)sizeof(ArenaBlock))
+
+static LLIB_TLS Pool **_pool_stack;
+static LLIB_TLS int _pool_depth, _pool_stack_cap, _pool_suspended;
+
+static void *arena_alloc(void *a, int size) {
+    Arena *arena = (Arena*)a;
+    ArenaBlock *b = arena->blocks;
+    size = ARENA_ALIGN(size);
+    if (! b || b->used + size > b->size) {
+        int bsize = size > ARENA_BLOCK_SIZE - ARENA_DATA ? size + ARENA_DATA : ARENA_BLOCK_SIZE;
+        ArenaBlock *nb = malloc(bsize);
+        nb->size = bsize;
+        nb->used = ARENA_DATA;
+        if (b && bsize != ARENA_BLOCK_SIZE) { // a big one-off; keep using the current block
+            nb->next = b->next;
+            b->next = nb;
+        } else {
+            nb->next = b;
+            arena->blocks = nb;
+        }
+        b = nb;
+    }
+    void *res = (char*)b + b->used;
+    b->used += size;
+    return res;
+}
 
-static VoidSeq _obj_pool;
-static VoidSeq _pool_stack;
-static ObjPool *_pool_marker;
+static void arena_free(void *a, void *P) {
+    // nothing to do; the arena goes as a whole
+}
+
+static void arena_release(Arena *arena) {
+    ArenaBlock *b = arena->blocks, *next;
+    for (; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+    free(arena);
+}
+
+static unsigned int pool_hash(const void *P) {
+    return (unsigned int)((size_t)P >> 3) * 2654435761u;
+}
+
+static void pool_reindex(Pool *pool) {
+    memset(pool->index,0,(pool->mask+1)*sizeof(int));
+    FOR(i,pool->n) {
+        if (pool->objs[i]) {
+            unsigned int k = pool_hash(pool->objs[i]);
+            while (pool->index[k & pool->mask] != 0)
+                ++k;
+            pool->index[k & pool->mask] = i+1;
+        }
+    }
+}
 
-static void seq_stack_push(VoidSeq stack, void *value) {
-    seq_add(_pool_stack,_obj_pool);
+// find the index entry for an object, or -1 if it isn't in this pool
+static int pool_find(Pool *pool, const void *P) {
+    for (unsigned int k = pool_hash(P);; ++k) {
+        int e = pool->index[k & pool->mask];
+        if (e == 0)
+            return -1;
+        if (e != POOL_REMOVED && pool->objs[e-1] == P)
+            return k & pool->mask;
+    }
 }
 
-static void *seq_stack_pop(VoidSeq stack) {
-    void **arr = *stack;
-    int top = array_len(arr)-1;
-    if (top == -1) // empty?
-        return NULL;
-    void *val = arr[top];
-    array_len(arr) = top;
-    return val;
+// make room for another object; either squeeze out the dead entries,
+// or grow the pool (and its index, which is kept at twice the capacity)
+static void pool_make_room(Pool *pool) {
+    if (pool->live <= pool->cap/2 && ! pool->draining) {
+        int j = 0;
+        FOR(i,pool->n) {
+            if (pool->objs[i])
+                pool->objs[j++] = pool->objs[i];
+        }
+        pool->n = j;
+    } else {
+        pool->cap *= 2;
+        pool->objs = realloc(pool->objs,pool->cap*sizeof(void*));
+        pool->mask = 2*pool->cap - 1;
+        pool->index = realloc(pool->index,2*pool->cap*sizeof(int));
+    }
+    pool_reindex(pool);
 }
 
 static void pool_add(void *P) {
-    seq_add(_obj_pool, P);
+    Pool *pool = _pool_stack[_pool_depth-1];
+    if (pool->n == pool->cap)
+        pool_make_room(pool);
+    unsigned int k = pool_hash(P);
+    while (pool->index[k & pool->mask] > 0)
+        ++k;
+    pool->index[k & pool->mask] = pool->n+1;
+    pool->objs[pool->n++] = P;
+    ++pool->live;
 }
 
 static void pool_clean(void *P) {
-    void **objs = *_obj_pool;
-    FOR(i,array_len(objs)) {
-        if (objs[i] == P) {
-            objs[i] = NULL;
-            break;
+    // usually in the innermost pool, but not necessarily
+    for (int i = _pool_depth-1; i >= 0; --i) {
+        Pool *pool = _pool_stack[i];
+        int k = pool_find(pool,P);
+        if (k != -1) {
+            pool->objs[pool->index[k]-1] = NULL;
+            pool->index[k] = POOL_REMOVED;
+            --pool->live;
+            return;
         }
     }
 }
 
-static void pool_dispose(ObjPool * p) {
-    // NB not to try any cleanup at this point!
-    _pool_cleaner = NULL;
-    obj_unref(*p);  // kill the actual pool (ref seq containing objects)
-    _pool_cleaner = pool_clean;
+// new objects go into the innermost pool, and come from its arena if
+// it has one, unless pools are suspended
+static void set_hooks() {
+    Pool *top = _pool_depth && ! _pool_suspended ? _pool_stack[_pool_depth-1] : NULL;
+    _pool_filter = top ? pool_add : NULL;
+    _pool_arena = top && top->arena ? &top->arena->alloc : NULL;
+}
 
-    _obj_pool = (VoidSeq)seq_stack_pop(_pool_stack);
+static void pool_dispose(ObjPool *p) {
+    Pool *pool = *p;
+    // anything freed while draining is taken out as usual, so objects
+    // owned by other pooled objects are not unref'd twice.
+    pool->draining = true;
+    for (int i = 0; i < pool->n; i++) {
+        if (pool->objs[i])
+            obj_unref(pool->objs[i]);
+    }
+    // usually the innermost pool, but pools may be disposed out of order
+    int i = _pool_depth-1;
+    while (_pool_stack[i] != pool)
+        --i;
+    memmove(&_pool_stack[i],&_pool_stack[i+1],(_pool_depth-i-1)*sizeof(Pool*));
+    --_pool_depth;
+    set_hooks();
+    if (pool->arena)
+        arena_release(pool->arena);
+    free(pool->objs);
+    free(pool->index);
+    free(pool);
 
-    if (_obj_pool == NULL) { // stop using the pool; it's dead!
-        _pool_marker = NULL;
-        _pool_filter = NULL;
+    if (_pool_depth == 0) { // stop using the pool; it's dead!
         _pool_cleaner = NULL;
-        obj_unref(_pool_stack);
+        free(_pool_stack);
         _pool_stack = NULL;
+        _pool_stack_cap = 0;
     }
 }
 
 /// create an object pool which will collect all references generated by llib
 void *obj_pool() {
-    if (! _pool_stack) {
-        _pool_stack = seq_new(void*);
-    }
-    // push  the current pool on the stack (will always be NULL initially)
-    seq_stack_push(_pool_stack,_obj_pool);
-    _obj_pool = seq_new_ref(void*);
     // the new pool is referenced by this object which controls
-    // the pool's lifetime
-    _pool_marker = obj_new(ObjPool,pool_dispose);
-    *_pool_marker = _obj_pool;
+    // the pool's lifetime. It belongs to any enclosing pool.
+    ObjPool *marker = obj_new(ObjPool,pool_dispose);
+    Pool *pool = malloc(sizeof(Pool));
+    pool->cap = POOL_INITIAL_CAP;
+    pool->n = pool->live = 0;
+    pool->objs = malloc(pool->cap*sizeof(void*));
+    pool->mask = 2*pool->cap - 1;
+    pool->index = calloc(2*pool->cap,sizeof(int));
+    pool->draining = false;
+    pool->arena = NULL;
+    *marker = pool;
+    if (_pool_depth == _pool_stack_cap) {
+        _pool_stack_cap = _pool_stack_cap ? 2*_pool_stack_cap : 4;
+        _pool_stack = realloc(_pool_stack,_pool_stack_cap*sizeof(Pool*));
+    }
+    _pool_stack[_pool_depth++] = pool;
     // the core will access the pool through these function pointers
-    _pool_filter = pool_add;
+    set_hooks();
     _pool_cleaner = pool_clean;
-    return (void*)_pool_marker;
+    return (void*)marker;
+}
+
+/// create an object pool which also allocates its objects from an arena.
+// While it is the innermost pool, new objects cost a pointer bump,
+// and all the memory is released when the pool is disposed.
+// Use `obj_keep` rather than `ref` for objects which must outlive the pool.
+void *obj_pool_arena() {
+    ObjPool *marker = (ObjPool*)obj_pool();
+    Arena *arena = malloc(sizeof(Arena));
+    arena->alloc.alloc = arena_alloc;
+    arena->alloc.free = arena_free;
+    arena->alloc.data = NULL;
+    arena->blocks = NULL;
+    (*marker)->arena = arena;
+    set_hooks();
+    return (void*)marker;
+}
+
+/// stop putting new objects into pools.
+// Until `obj_pool_resume`, new objects belong to no pool and don't come
+// from an arena. This is for objects which are owned by other objects,
+// or kept by the library itself, like caches. Calls may be nested.
+void obj_pool_suspend() {
+    ++_pool_suspended;
+    set_hooks();
+}
+
+/// go back to putting new objects into the innermost pool.
+// Each call must match an `obj_pool_suspend`; an unmatched one is ignored
+// (and caught in debug builds).
+void obj_pool_resume() {
+    assert(_pool_suspended > 0);
+    if (_pool_suspended > 0)
+        --_pool_suspended;
+    set_hooks();
+}
+
+/// number of objects alive in a pool.
+int obj_pool_count(void *P) {
+    return (*(ObjPool*)P)->live;
+}
+
+/// how many object pools are active in this thread.
+int obj_pool_depth() {
+    return _pool_depth;
 }
 
 // this is a helper for the magic 'scoped' macro
@@ -0,0 +1,192 @@
+/*
+* llib little C library
+* BSD licence
+* Copyright Steve Donovan, 2013
+*/
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <string.h>
+#include "obj.h"
+
+/***
+A size-class slab allocator for small objects.
+
+Types opt into this by setting their `alloc` field to `obj_slab_allocator()`,
+which must happen before any objects of that type are created.
+Requests of up to `SLAB_MAX_SIZE` bytes are rounded up to a multiple of 16 and
+served from a free list for that size class; these lists are refilled by carving
+up 64K blocks. Larger requests go to `malloc`.
+
+Blocks are aligned on their size, so the block containing a chunk is found by
+masking its address. A global set of block addresses tells slab chunks
+apart from `malloc`'d memory when freeing. Blocks are never returned to
+the system.
+
+In thread-safe builds each thread has its own free lists and blocks, so
+there is no locking; a chunk freed by another thread simply joins that
+thread's list. The statistics are counted per thread too, and added up over
+all threads when read, so that a chunk freed by another thread still balances
+the books.
+
+@module slab
+*/
+
+#define SLAB_BLOCK_SIZE 0x10000
+#define SLAB_GRAIN 16
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASSES (SLAB_MAX_SIZE/SLAB_GRAIN)
+// (with this many blocks we have a gigabyte of small objects!)
+#define SLAB_MAX_BLOCKS 16384
+
+typedef struct SlabChunk_ {
+    struct SlabChunk_ *next;
+} SlabChunk;
+
+typedef struct SlabBlock_ {
+    int cls;
+    int used; // bytes carved from this block so far
+    // keep the chunks 16-byte aligned
+    char _pad[SLAB_GRAIN - 2*sizeof(int)];
+} SlabBlock;
+
+typedef struct SlabState_ {
+    SlabChunk *free[SLAB_CLASSES];
+    SlabBlock *current[SLAB_CLASSES];
+} SlabState;
+
+static LLIB_TLS SlabState slab;
+
+// (like the object counts, these go to a new thread when their thread exits)
+typedef struct SlabCounts_ {
+    ObjCounterBlock hdr;
+    ObjSlabStats stats;
+} SlabCounts;
+
+static ObjCounterBlock *all_stats;
+static LLIB_TLS ObjCounterBlock *my_stats;
+
+static ObjSlabStats *slab_stats() {
+    SlabCounts *c = (SlabCounts*)my_stats;
+    if (! c)
+        c = (SlabCounts*)obj_counter_block(&all_stats,sizeof(SlabCounts),&my_stats);
+    return &c->stats;
+}
+
+#define SLAB_ADD(field,n) OBJ_LOCAL_ADD(slab_stats()->field,n)
+
+static void *blocks[SLAB_MAX_BLOCKS];
+
+static unsigned int block_hash(void *b) {
+    return (unsigned int)((size_t)b / SLAB_BLOCK_SIZE) * 2654435761u;
+}
+
+static bool add_block(void *b) {
+    for (unsigned int i = block_hash(b), k = 0; k < SLAB_MAX_BLOCKS; ++i, ++k) {
+        void *old = NULL;
+        if (OBJ_ATOMIC_CAS(blocks[i % SLAB_MAX_BLOCKS],old,b))
+            return true;
+    }
+    return false;
+}
+
+static bool is_block(void *b) {
+    for (unsigned int i = block_hash(b), k = 0; k < SLAB_MAX_BLOCKS; ++i, ++k) {
+        void *e = OBJ_ATOMIC_LOAD(blocks[i % SLAB_MAX_BLOCKS]);
+        if (e == b)
+            return true;
+        if (e == NULL)
+            return false;
+    }
+    return false;
+}
+
+static SlabBlock *new_block(int cls) {
+    void *mem;
+    if (posix_memalign(&mem,SLAB_BLOCK_SIZE,SLAB_BLOCK_SIZE) != 0)
+        return NULL;
+    if (! add_block(mem)) { // the block set is full
+        free(mem);
+        return NULL;
+    }
+    SlabBlock *b = (SlabBlock*)mem;
+    b->cls = cls;
+    b->used = sizeof(SlabBlock);
+    slab.current[cls] = b;
+    SLAB_ADD(blocks,1);
+    SLAB_ADD(reserved,SLAB_BLOCK_SIZE);
+    return b;
+}
+
+static void *slab_alloc(void *a, int size) {
+    if (size > SLAB_MAX_SIZE) {
+        SLAB_ADD(large,1);
+        return malloc(size);
+    }
+    int cls = (size - 1)/SLAB_GRAIN, csize = (cls + 1)*SLAB_GRAIN;
+    SlabChunk *c = slab.free[cls];
+    SLAB_ADD(allocs,1);
+    SLAB_ADD(in_use,csize);
+    SLAB_ADD(wasted,csize - size);
+    if (c) {
+        slab.free[cls] = c->next;
+        SLAB_ADD(hits,1);
+        return c;
+    }
+    SlabBlock *b = slab.current[cls];
+    if (! b || b->used + csize > SLAB_BLOCK_SIZE) {
+        b = new_block(cls);
+        if (! b) {
+            SLAB_ADD(in_use,-csize);
+            SLAB_ADD(large,1);
+            return malloc(size);
+        }
+    }
+    c = (SlabChunk*)((char*)b + b->used);
+    b->used += csize;
+    return c;
+}
+
+static void slab_free(void *a, void *p) {
+    SlabBlock *b = (SlabBlock*)((size_t)p & ~(size_t)(SLAB_BLOCK_SIZE-1));
+    if (! is_block(b)) {
+        free(p);
+        return;
+    }
+    SlabChunk *c = (SlabChunk*)p;
+    int cls = b->cls;
+    c->next = slab.free[cls];
+    slab.free[cls] = c;
+    SLAB_ADD(frees,1);
+    SLAB_ADD(in_use,-(cls + 1)*SLAB_GRAIN);
+}
+
+static ObjAllocator slab_allocator = {
+    slab_alloc, slab_free, NULL
+};
+
+/// the slab allocator.
+// Set a type's `alloc` field to this before any objects of that type
+// are created, e.g. `obj_type_at(OBJ_DOUBLE_T)->alloc = obj_slab_allocator()`
+ObjAllocator *obj_slab_allocator() {
+    return &slab_allocator;
+}
+
+/// statistics for the slab allocator, added up over all threads.
+// `hits` is how many allocations came from a free list, and
+// `fragmentation` is the part of the reserved block memory which is
+// not currently in use, either free or never carved.
+void obj_slab_stats(ObjSlabStats *st) {
+    memset(st,0,sizeof(ObjSlabStats));
+    for (SlabCounts *c = (SlabCounts*)OBJ_ATOMIC_LOAD(all_stats); c; c = (SlabCounts*)c->hdr.next) {
+        st->allocs += OBJ_ATOMIC_LOAD(c->stats.allocs);
+        st->hits += OBJ_ATOMIC_LOAD(c->stats.hits);
+        st->frees += OBJ_ATOMIC_LOAD(c->stats.frees);
+        st->large += OBJ_ATOMIC_LOAD(c->stats.large);
+        st->blocks += OBJ_ATOMIC_LOAD(c->stats.blocks);
+        st->reserved += OBJ_ATOMIC_LOAD(c->stats.reserved);
+        st->in_use += OBJ_ATOMIC_LOAD(c->stats.in_use);
+        st->wasted += OBJ_ATOMIC_LOAD(c->stats.wasted);
+    }
+    st->hit_rate = st->allocs ? (double)st->hits/st->allocs : 0;
+    st->fragmentation = st->reserved ? 1 - (double)st->in_use/st->reserved : 0;
+}
@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #ifdef _MSC_VER
 #define strtoll _strtoi64
 #define snprintf _snprintf
@@ -50,33 +51,83 @@ void obj_set_type(void *P,int t) {
     h->type = t;
 }
 
+// errors are created with their own type, rather than changing the type
+// of a string, since the types may have different allocators
 PValue value_error (const char *msg) {
-    PValue v = str_new(msg);
-    obj_set_type(v,OBJ_ECHAR_T);
+    int sz = strlen(msg);
+    char *v = (char*)array_new_(1,"echar_",sz,0);
+    memcpy(v,msg,sz);
     return v;
 }
 
-PValue value_float (double x) {
+// Boxed values are immutable, so common ones are shared.
+// `true` and `false` are singletons, and small integers (and
+// floats with integer values) come from a cache of preboxed values.
+// These are boxed on first use, outside any pool or arena, since they
+// live forever; if two threads race, one box wins.
+#define VALUE_CACHE_MIN -128
+#define VALUE_CACHE_MAX 1023
+#define VALUE_CACHE_SIZE (VALUE_CACHE_MAX - VALUE_CACHE_MIN + 1)
+
+static PValue s_true, s_false;
+static PValue s_ints[VALUE_CACHE_SIZE];
+static PValue s_floats[VALUE_CACHE_SIZE];
+
+static PValue cached(PValue *pv, PValue box) {
+    PValue old = NULL;
+    obj_pool_resume();
+    obj_immortal(box);
+    return OBJ_ATOMIC_CAS(*pv,old,box) ? box : old;
+}
+
+// (the box is made after the pools are suspended; `cached` resumes them)
+#define CACHED(pv,box) (obj_pool_suspend(), cached(pv,box))
+
+static PValue box_float(double x) {
     double *px = array_new(double,1);
     *px = x;
     obj_is_array(px) = 0;
     return (PValue)px;
 }
 
-PValue value_int (long long i) {
+static PValue box_int(long long i) {
     long long *px = array_new(long long,1);
     *px = i;
     obj_is_array(px) = 0;
     return (PValue)px;
 }
 
-PValue value_bool (bool i) {
+static PValue box_bool(bool i) {
     bool *px = array_new(bool,1);
     *px = i;
     obj_is_array(px) = 0;
     return (PValue)px;
 }
 
+PValue value_float (double x) {
+    if (x >= VALUE_CACHE_MIN && x <= VALUE_CACHE_MAX && x == (int)x && ! (x == 0 && signbit(x))) {
+        PValue *pv = &s_floats[(int)x - VALUE_CACHE_MIN];
+        PValue v = OBJ_ATOMIC_LOAD(*pv);
+        return v ? v : CACHED(pv,box_float(x));
+    }
+    return box_float(x);
+}
+
+PValue value_int (long long i) {
+    if (i >= VALUE_CACHE_MIN && i <= VALUE_CACHE_MAX) {
+        PValue *pv = &s_ints[i - VALUE_CACHE_MIN];
+        PValue v = OBJ_ATOMIC_LOAD(*pv);
+        return v ? v : CACHED(pv,box_int(i));
+    }
+    return box_int(i);
+}
+
+PValue value_bool (bool i) {
+    PValue *pv = i ? &s_true : &s_false;
+    PValue v = OBJ_ATOMIC_LOAD(*pv);
+    return v ? v : CACHED(pv,box_bool(i));
+}
+
 #define str_eq(s1,s2) (strcmp((s1),(s2))==0)
 
 static PValue conversion_error(const char *s, const char *t) {
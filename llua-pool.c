@@ -0,0 +1,264 @@
+/***
+A pool of Lua states, each pinned to its own worker thread.
+
+Calls are made by global function name, with llib values as arguments,
+and are queued for whichever worker is free. Each call returns a future
+which will hold the result, or an error string.
+
+Needs a thread-safe llib (-DLLIB_THREADS -pthread).
+
+@license BSD
+@copyright Steve Donovan,2014
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "llua-pool.h"
+
+#ifndef LLIB_THREADS
+#error "llua-pool must be built with -DLLIB_THREADS"
+#endif
+
+struct LLuaFuture_ {
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    bool done;
+    void *result;
+};
+
+typedef struct Job_ {
+    char *fname;
+    void **args;
+    llua_future_t *future;
+    struct Job_ *next;
+} Job;
+
+struct LLuaPool_ {
+    int n;
+    pthread_t *threads;
+    const char *init;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;   // a job was queued, or we are closing
+    pthread_cond_t ready_cond;  // a worker finished starting up
+    Job *head, *tail;
+    bool closing;
+    int started;
+    char *init_error;
+};
+
+static void future_dispose(llua_future_t *F) {
+    pthread_mutex_destroy(&F->lock);
+    pthread_cond_destroy(&F->done_cond);
+    obj_unref(F->result);
+}
+
+static void future_set(llua_future_t *F, void *result) {
+    if (result)
+        obj_share(result);
+    pthread_mutex_lock(&F->lock);
+    F->result = result;
+    F->done = true;
+    pthread_cond_broadcast(&F->done_cond);
+    pthread_mutex_unlock(&F->lock);
+    obj_unref(F); // the worker's reference
+}
+
+/// wait for the result of a call.
+// This is a llib value (strings, numbers and booleans come back as
+// strings and boxed values; nil as NULL) or an error string. It belongs
+// to the future, so `ref` it to keep it after the future is released.
+void *llua_future_wait(llua_future_t *F) {
+    pthread_mutex_lock(&F->lock);
+    while (! F->done)
+        pthread_cond_wait(&F->done_cond,&F->lock);
+    pthread_mutex_unlock(&F->lock);
+    return F->result;
+}
+
+/// has the call finished?
+bool llua_future_ready(llua_future_t *F) {
+    bool done;
+    pthread_mutex_lock(&F->lock);
+    done = F->done;
+    pthread_mutex_unlock(&F->lock);
+    return done;
+}
+
+// only values which mean the same in any state can cross over
+static err_t pool_result(lua_State *L, void **res) {
+    switch(lua_type(L,-1)) {
+    case LUA_TNIL: case LUA_TNUMBER: case LUA_TBOOLEAN: case LUA_TSTRING:
+        *res = llua_to_obj(L,-1);
+        return NULL;
+    default:
+        return "pool calls can only return nil, numbers, booleans and strings";
+    }
+}
+
+// the message of the error on the stack; Lua errors need not be strings
+static const char *error_message(lua_State *L, char *buff, int size) {
+    const char *msg = lua_tostring(L,-1);
+    if (! msg) {
+        snprintf(buff,size,"(error object is a %s value)",luaL_typename(L,-1));
+        msg = buff;
+    }
+    return msg;
+}
+
+static void *run_job(lua_State *L, Job *job) {
+    int nargs = job->args ? array_len(job->args) : 0;
+    void *res = NULL;
+    lua_getglobal(L,job->fname);
+    if (! lua_isfunction(L,-1)) {
+        char buff[256];
+        lua_pop(L,1);
+        snprintf(buff,sizeof(buff),"no function '%s'",job->fname);
+        return value_error(buff);
+    }
+    for (int i = 0; i < nargs; i++)
+        llua_push_object(L,job->args[i]);
+    if (lua_pcall(L,nargs,1,0) != 0) {
+        char buff[64];
+        res = value_error(error_message(L,buff,sizeof(buff)));
+    } else {
+        err_t err = pool_result(L,&res);
+        if (err)
+            res = value_error(err);
+    }
+    lua_pop(L,1);
+    return res;
+}
+
+static void *worker(void *arg) {
+    llua_pool_t *P = (llua_pool_t*)arg;
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+    bool ok = luaL_loadstring(L,P->init) == 0 && lua_pcall(L,0,0,0) == 0;
+
+    pthread_mutex_lock(&P->lock);
+    if (! ok) {
+        char buff[64];
+        if (! P->init_error)
+            P->init_error = obj_share(str_new(error_message(L,buff,sizeof(buff))));
+        lua_pop(L,1);
+    }
+    ++P->started;
+    pthread_cond_signal(&P->ready_cond);
+    for(;;) {
+        while (! P->head && ! P->closing)
+            pthread_cond_wait(&P->work_cond,&P->lock);
+        Job *job = P->head;
+        if (! job) // closing, and nothing left to do
+            break;
+        P->head = job->next;
+        if (! P->head)
+            P->tail = NULL;
+        pthread_mutex_unlock(&P->lock);
+
+        future_set(job->future,run_job(L,job));
+        obj_unref(job->args);
+        free(job->fname);
+        free(job);
+
+        pthread_mutex_lock(&P->lock);
+    }
+    pthread_mutex_unlock(&P->lock);
+    lua_close(L);
+    return NULL;
+}
+
+static void pool_dispose(llua_pool_t *P) {
+    pthread_mutex_lock(&P->lock);
+    P->closing = true;
+    pthread_cond_broadcast(&P->work_cond);
+    pthread_mutex_unlock(&P->lock);
+    for (int i = 0; i < P->n; i++)
+        pthread_join(P->threads[i],NULL);
+    free(P->threads);
+    obj_unref(P->init_error);
+    pthread_mutex_destroy(&P->lock);
+    pthread_cond_destroy(&P->work_cond);
+    pthread_cond_destroy(&P->ready_cond);
+}
+
+/// a pool of `nstates` Lua states, each with its own worker thread.
+// Every state runs the Lua code `init` first, which would usually
+// define the global functions to be called. Returns an error if
+// `init` fails in any state. When the pool is released with `unref`,
+// the calls already queued are finished and the workers are joined.
+// @usage P = llua_pool_new(4,"dofile 'handlers.lua'");
+llua_pool_t *llua_pool_new(int nstates, const char *init) {
+    llua_pool_t *P = obj_new(llua_pool_t,pool_dispose);
+    P->n = 0;
+    P->threads = malloc(nstates*sizeof(pthread_t));
+    P->init = init;
+    pthread_mutex_init(&P->lock,NULL);
+    pthread_cond_init(&P->work_cond,NULL);
+    pthread_cond_init(&P->ready_cond,NULL);
+    P->head = P->tail = NULL;
+    P->closing = false;
+    P->started = 0;
+    P->init_error = NULL;
+    for (; P->n < nstates; P->n++) {
+        if (pthread_create(&P->threads[P->n],NULL,worker,P) != 0)
+            break;
+    }
+    pthread_mutex_lock(&P->lock);
+    while (P->started < P->n)
+        pthread_cond_wait(&P->ready_cond,&P->lock);
+    pthread_mutex_unlock(&P->lock);
+    P->init = NULL;
+    if (P->n < nstates || P->init_error) {
+        void *err = value_error(P->init_error ? P->init_error : "cannot create worker thread");
+        obj_unref(P);
+        return (llua_pool_t*)err;
+    }
+    return P;
+}
+
+/// number of states in the pool.
+int llua_pool_size(llua_pool_t *P) {
+    return P->n;
+}
+
+/// queue a call to the global function `fname`.
+// `args` is NULL or a reference array of llib values (not Lua references,
+// which belong to another state), and the pool takes over the caller's
+// reference to it; it and its elements are shared with the worker
+// thread. The returned future has to be released with `unref`.
+llua_future_t *llua_pool_call(llua_pool_t *P, const char *fname, void **args) {
+    if (args) {
+        for (int i = 0, n = array_len(args); i < n; i++) {
+            if (llua_is_lua_object(args[i])) {
+                obj_unref(args);
+                return (llua_future_t*)value_error("Lua references cannot be passed to a pool");
+            }
+        }
+        obj_share(args);
+    }
+    llua_future_t *F = obj_new(llua_future_t,future_dispose);
+    pthread_mutex_init(&F->lock,NULL);
+    pthread_cond_init(&F->done_cond,NULL);
+    F->done = false;
+    F->result = NULL;
+    obj_share(F);
+    obj_incr_(F); // for the worker
+
+    Job *job = malloc(sizeof(Job));
+    job->fname = malloc(strlen(fname) + 1);
+    strcpy(job->fname,fname);
+    job->args = args;
+    job->future = F;
+    job->next = NULL;
+    pthread_mutex_lock(&P->lock);
+    if (P->tail)
+        P->tail->next = job;
+    else
+        P->head = job;
+    P->tail = job;
+    pthread_cond_signal(&P->work_cond);
+    pthread_mutex_unlock(&P->lock);
+    return F;
+}
@@ -0,0 +1,16 @@
+#ifndef LLUA_POOL_H
+#define LLUA_POOL_H
+// A pool of worker threads, each owning a Lua state. Needs a thread-safe
+// llib (-DLLIB_THREADS -pthread).
+#include "llua.h"
+
+typedef struct LLuaPool_ llua_pool_t;
+typedef struct LLuaFuture_ llua_future_t;
+
+llua_pool_t *llua_pool_new(int nstates, const char *init);
+int llua_pool_size(llua_pool_t *P);
+llua_future_t *llua_pool_call(llua_pool_t *P, const char *fname, void **args);
+void *llua_future_wait(llua_future_t *F);
+bool llua_future_ready(llua_future_t *F);
+
+#endif
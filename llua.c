@@ -8,8 +8,15 @@ stack becomes unnecessary.
 @copyright Steve Donovan,2014
 */
 
+#define _POSIX_C_SOURCE 200809L // for clock_gettime
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <assert.h>
+#include <limits.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include "llua.h"
 
@@ -21,6 +28,27 @@ stack becomes unnecessary.
 
 static FILE *s_verbose = false;
 
+// Always on, and only ever added to (see llua_stats). Each thread has its
+// own counters, so counting is a plain add; they are added up when read.
+// When a thread exits, its counters go to the next new thread (see
+// `obj_counter_block`).
+typedef struct StatsBlock_ {
+    ObjCounterBlock hdr;
+    llua_stats_t st;
+} StatsBlock;
+
+static ObjCounterBlock *s_all_stats;
+static LLIB_TLS ObjCounterBlock *s_my_stats;
+
+static llua_stats_t *stats_here() {
+    StatsBlock *b = (StatsBlock*)s_my_stats;
+    if (! b)
+        b = (StatsBlock*)obj_counter_block(&s_all_stats,sizeof(StatsBlock),&s_my_stats);
+    return &b->st;
+}
+
+#define STAT_ADD(field,n) OBJ_LOCAL_ADD(stats_here()->field,n)
+
 /// raise an error when the argument is an error.
 // @function llua_assert
 
@@ -49,7 +77,7 @@ const char *llua_error(llua_t *o, const char *msg) {
 /// is this a Lua reference?
 // @within Properties
 bool llua_is_lua_object(llua_t *o) {
-    return obj_is_instance(o,"llua_t");
+    return obj_refcount(o) != -1 && obj_type_index(o) == OBJ_LLUA_T;
 }
 
 static void llua_Dispose(llua_t *o) {
@@ -57,17 +85,41 @@ static void llua_Dispose(llua_t *o) {
         fprintf(s_verbose,"free L %p ref %d type %s\n",o->L,o->ref,llua_typename(o));
     }
     luaL_unref(o->L,LUA_REGISTRYINDEX,o->ref);
+    STAT_ADD(refs_freed,1);
+}
+
+// references have their own fixed type slot and use the slab. This is set
+// up once, even if several threads make their first reference together.
+static ObjType *s_llua_type;
+static int s_llua_type_state; // 1 while initializing, 2 when done
+
+static ObjType *llua_type() {
+    int state = OBJ_ATOMIC_LOAD(s_llua_type_state);
+    if (state == 2)
+        return s_llua_type;
+    if (state == 0 && OBJ_ATOMIC_CAS(s_llua_type_state,state,1)) {
+        ObjType *t = obj_reserved_type(OBJ_LLUA_T,sizeof(llua_t),(DisposeFn)llua_Dispose);
+        t->alloc = obj_slab_allocator();
+        s_llua_type = t;
+        OBJ_ATOMIC_STORE(s_llua_type_state,2);
+    } else { // another thread is doing it
+        while (OBJ_ATOMIC_LOAD(s_llua_type_state) != 2)
+            ;
+    }
+    return s_llua_type;
 }
 
 /// new Lua reference to value on stack.
 // @within Creating
 llua_t *llua_new(lua_State *L, int idx) {
-    llua_t *res = obj_new(llua_t,llua_Dispose);
+    llua_t *res = obj_new_from_type(llua_type());
     res->L = L;
     lua_pushvalue(L,idx);
     res->ref = luaL_ref(L,LUA_REGISTRYINDEX);
     res->type = lua_type(L,idx);
     res->error = false;
+    res->borrowed = false;
+    STAT_ADD(refs_created,1);
     return res;
 }
 
@@ -112,6 +164,8 @@ static char *string_copy(lua_State *L, int idx) {
     const char *s = lua_tolstring(L,idx,&sz);
     char *res = str_new_size(sz);
     memcpy(res,s,sz);
+    STAT_ADD(copies,1);
+    STAT_ADD(copied_bytes,sz);
     return res;
 }
 
@@ -166,6 +220,310 @@ llua_t *llua_cfunction(lua_State *L, lua_CFunction f) {
     return ref;
 }
 
+///// Handles
+// An alternative to `llua_t` for holding very many values. A handle is a
+// 64-bit value: a 32-bit slot index plus a 32-bit generation count, so stale
+// handles are caught. The values live in one Lua table; on the C side there
+// is just a generation count and a 'used' bit per slot. Free slots are reused
+// lowest first, so that the live slots stay packed and the table (and these
+// arrays) can be rebuilt smaller when the top of it empties. Live slots are
+// never moved, since that would change their handles, so one long-lived
+// handle high up keeps everything at its peak size. The index is stored plus
+// one, so that 0 is never a handle. A slot whose generation runs out is
+// retired (left marked as used) rather than wrapping round to match old
+// handles again.
+
+#define HANDLE_INDEX_BITS 32
+#define HANDLE_MAX_SLOTS (1 << 30)
+#define HANDLE_GEN_RETIRED 0xFFFFFFFFu
+#define HANDLE_MIN_REBUILD 64
+
+// slot of a handle or task id, or -1 if its index is out of range
+static int handle_index(unsigned long long h) {
+    unsigned long long i = h & 0xFFFFFFFFULL;
+    return (i == 0 || i > HANDLE_MAX_SLOTS) ? -1 : (int)i - 1;
+}
+
+#define HANDLE_GEN(h) ((uint32)((h) >> HANDLE_INDEX_BITS))
+#define HANDLE_MAKE(gen,k) (((unsigned long long)(gen) << HANDLE_INDEX_BITS) | (unsigned long long)((k) + 1))
+
+struct LLuaHandles_ {
+    lua_State *L;
+    int ref;        // the table of values
+    uint32 *gen;
+    unsigned long long *used;
+    int cap;        // slots in gen and used
+    int top;        // one past the highest live slot
+    int built;      // the most slots the value table has held since it was rebuilt
+    int live;
+    int hint;       // no free slot in any `used` word below this
+    uint32 gen_base; // generation of new slots, newer than any dropped slot
+};
+
+static void llua_handles_dispose(llua_handles_t *H) {
+    luaL_unref(H->L,LUA_REGISTRYINDEX,H->ref);
+    free(H->gen);
+    free(H->used);
+}
+
+/// a new table of handles.
+// @within Creating
+llua_handles_t *llua_handles_new(lua_State *L) {
+    llua_handles_t *H = obj_new(llua_handles_t,llua_handles_dispose);
+    H->L = L;
+    lua_newtable(L);
+    H->ref = luaL_ref(L,LUA_REGISTRYINDEX);
+    H->gen = NULL;
+    H->used = NULL;
+    H->cap = H->top = H->built = H->live = H->hint = 0;
+    H->gen_base = 0;
+    return H;
+}
+
+#define SLOT_USED(H,k) (((H)->used[(k) >> 6] >> ((k) & 63)) & 1)
+
+static int lowest_zero(unsigned long long w) {
+#ifdef __GNUC__
+    return __builtin_ctzll(~w);
+#else
+    int i = 0;
+    for (; w & 1; w >>= 1)
+        ++i;
+    return i;
+#endif
+}
+
+// slot of a live handle, or -1
+static int handle_slot(llua_handles_t *H, llua_handle_t h) {
+    int k = handle_index(h);
+    if (k < 0 || k >= H->top || ! SLOT_USED(H,k) || H->gen[k] != HANDLE_GEN(h) || H->gen[k] == HANDLE_GEN_RETIRED)
+        return -1;
+    return k;
+}
+
+// copy the live values into a table which is no bigger than it needs to be
+static void handles_rebuild(llua_handles_t *H) {
+    lua_State *L = H->L;
+    lua_rawgeti(L,LUA_REGISTRYINDEX,H->ref);
+    lua_createtable(L,H->top,0);
+    for (int k = 0; k < H->top; k++) {
+        if (SLOT_USED(H,k)) {
+            lua_rawgeti(L,-2,k+1);
+            lua_rawseti(L,-2,k+1);
+        }
+    }
+    lua_rawseti(L,LUA_REGISTRYINDEX,H->ref);
+    lua_pop(L,1);
+    H->built = H->top;
+    // the slots above the top are all free; keep a power of two which covers it.
+    // Stale handles to the dropped slots must not match when they come back.
+    int cap = 64;
+    while (cap < H->top)
+        cap *= 2;
+    if (cap < H->cap) {
+        for (int k = cap; k < H->cap; k++)
+            if (H->gen[k] > H->gen_base)
+                H->gen_base = H->gen[k];
+        H->gen = realloc(H->gen,cap*sizeof(uint32));
+        H->used = realloc(H->used,cap/64*sizeof(unsigned long long));
+        H->cap = cap;
+        if (H->hint > cap/64)
+            H->hint = cap/64;
+    }
+}
+
+/// make a handle for the value at `idx`.
+// Returns 0 if there is no room (more than a billion handles).
+// @within Creating
+llua_handle_t llua_handle_new(llua_handles_t *H, int idx) {
+    lua_State *L = H->L;
+    int w = H->hint, nwords = H->cap / 64;
+    while (w < nwords && H->used[w] == ~0ULL)
+        ++w;
+    if (w == nwords) { // grow
+        int cap = H->cap ? 2*H->cap : 64;
+        if (cap > HANDLE_MAX_SLOTS)
+            return 0;
+        H->gen = realloc(H->gen,cap*sizeof(uint32));
+        H->used = realloc(H->used,cap/64*sizeof(unsigned long long));
+        for (int k = H->cap; k < cap; k++)
+            H->gen[k] = H->gen_base;
+        memset(H->used + nwords,0,(cap - H->cap)/64*sizeof(unsigned long long));
+        H->cap = cap;
+    }
+    H->hint = w;
+    int k = 64*w + lowest_zero(H->used[w]);
+    H->used[w] |= 1ULL << (k & 63);
+    ++H->live;
+    if (k >= H->top)
+        H->top = k + 1;
+    if (H->top > H->built)
+        H->built = H->top;
+    lua_pushvalue(L,idx);
+    lua_rawgeti(L,LUA_REGISTRYINDEX,H->ref);
+    lua_insert(L,-2);
+    lua_rawseti(L,-2,k+1);
+    lua_pop(L,1);
+    return HANDLE_MAKE(H->gen[k],k);
+}
+
+/// push the value of a handle.
+// Returns false, pushing nothing, if the handle is stale.
+// @within Creating
+bool llua_handle_push(llua_handles_t *H, llua_handle_t h) {
+    int k = handle_slot(H,h);
+    if (k < 0)
+        return false;
+    lua_rawgeti(H->L,LUA_REGISTRYINDEX,H->ref);
+    lua_rawgeti(H->L,-1,k+1);
+    lua_remove(H->L,-2);
+    return true;
+}
+
+/// a reference to the value of a handle, for use with the rest of llua.
+// Returns an error if the handle is stale.
+// @within Creating
+llua_t *llua_handle_get(llua_handles_t *H, llua_handle_t h) {
+    if (! llua_handle_push(H,h))
+        return (llua_t*)value_error("stale handle");
+    llua_t *res = llua_new(H->L,-1);
+    lua_pop(H->L,1);
+    return res;
+}
+
+/// release a handle.
+// Its slot may be reused, but the old handle stays stale. The table and
+// the slot arrays are rebuilt smaller when the live slots only use a quarter
+// of them; only free slots at the top can be dropped, since live slots keep
+// their index.
+// Returns false if the handle was already stale.
+// @within Creating
+bool llua_handle_free(llua_handles_t *H, llua_handle_t h) {
+    lua_State *L = H->L;
+    int k = handle_slot(H,h);
+    if (k < 0)
+        return false;
+    // a slot which has used up its generations stays 'used', so it is never handed out again
+    if (++H->gen[k] != HANDLE_GEN_RETIRED) {
+        H->used[k >> 6] &= ~(1ULL << (k & 63));
+        if (k/64 < H->hint)
+            H->hint = k/64;
+    }
+    --H->live;
+    lua_rawgeti(L,LUA_REGISTRYINDEX,H->ref);
+    lua_pushnil(L);
+    lua_rawseti(L,-2,k+1);
+    lua_pop(L,1);
+    while (H->top > 0 && ! SLOT_USED(H,H->top-1))
+        --H->top;
+    if (H->built > HANDLE_MIN_REBUILD && H->top < H->built/4)
+        handles_rebuild(H);
+    return true;
+}
+
+/// number of live handles.
+// @within Properties
+int llua_handles_count(llua_handles_t *H) {
+    return H->live;
+}
+
+///// Borrowed references
+// A borrowed reference is a `llua_t` which refers to a stack slot rather
+// than the registry, so making one costs neither a `luaL_ref` nor an
+// allocation. Scopes and their references are recycled per thread.
+// Debug builds never recycle a borrowed reference; it is marked dead
+// when its scope ends, so later use is caught in `llua_push`.
+
+struct LLuaScope_ {
+    lua_State *L;
+    int top;
+    int n, cap;
+    llua_t **refs;
+    struct LLuaScope_ *next;
+};
+
+static LLIB_TLS llua_scope_t *s_free_scopes;
+
+/// start a scope for borrowed references.
+// The scope ends with `llua_scope_end`, which also restores the stack
+// to what it was here. Scopes nest, and must be ended in reverse order.
+// @within Creating
+// @usage llua_scope_t *S = llua_scope_begin(L);
+llua_scope_t *llua_scope_begin(lua_State *L) {
+    llua_scope_t *S = s_free_scopes;
+    if (S) {
+        s_free_scopes = S->next;
+    } else {
+        S = malloc(sizeof(llua_scope_t));
+        S->n = S->cap = 0;
+        S->refs = NULL;
+    }
+    S->L = L;
+    S->top = lua_gettop(L);
+    S->next = NULL;
+    return S;
+}
+
+/// borrow a reference to the value at `idx`.
+// It can be used anywhere a `llua_t` can, but only until the scope
+// ends, and only while the slot keeps its value. Use `llua_new` for a
+// reference which must last longer; `ref` and `unref` do nothing to it.
+// Objects which keep a reference, like signatures and iterators, make
+// their own real reference from a borrowed one.
+// @within Creating
+llua_t *llua_borrow(llua_scope_t *S, int idx) {
+    lua_State *L = S->L;
+    llua_t *o;
+    if (S->n == S->cap) {
+        int cap = S->cap ? 2*S->cap : 8;
+        S->refs = realloc(S->refs,cap*sizeof(llua_t*));
+        memset(S->refs + S->cap,0,(cap - S->cap)*sizeof(llua_t*));
+        S->cap = cap;
+    }
+    o = S->refs[S->n];
+    if (! o) {
+        // it takes no registry slot (so isn't counted as a reference),
+        // belongs to no pool (or arena) and is never freed
+        obj_pool_suspend();
+        o = obj_immortal(obj_new_from_type(llua_type()));
+        obj_pool_resume();
+        o->borrowed = true;
+        S->refs[S->n] = o;
+    }
+    ++S->n;
+    o->L = L;
+    o->ref = idx > 0 || idx <= LUA_REGISTRYINDEX ? idx : lua_gettop(L) + idx + 1;
+    o->type = lua_type(L,idx);
+    o->error = false;
+    return o;
+}
+
+// a reference for an object to keep. A borrowed reference is recycled
+// when its scope ends, so then we need a real reference to the value.
+static llua_t *llua_hold(llua_t *o) {
+    if (! o->borrowed)
+        return obj_keep(o);
+    obj_pool_suspend();
+    llua_t *res = llua_new(o->L,o->ref);
+    obj_pool_resume();
+    return res;
+}
+
+/// end a scope, invalidating its borrowed references.
+// @within Creating
+void llua_scope_end(llua_scope_t *S) {
+    lua_settop(S->L,S->top);
+#ifdef DEBUG
+    for (int i = 0; i < S->n; i++) {
+        S->refs[i]->ref = 0;
+        S->refs[i] = NULL;
+    }
+#endif
+    S->n = 0;
+    S->next = s_free_scopes;
+    s_free_scopes = S;
+}
+
 static err_t l_error(lua_State *L) {
     const char *errstr = value_error(lua_tostring(L,-1));
     lua_pop(L,1);
@@ -182,10 +540,141 @@ llua_t *llua_load(lua_State *L, const char *code, const char *name) {
    return llua_to_obj_pop(L,-1);
 }
 
+///// Bytecode cache
+// A cache file is named by a hash of the Lua release and the file's name, so
+// each source file has one cache file. It starts with a text line giving
+// the release, that hash, a hash of the contents, and the bytecode size; the
+// bytecode follows. Anything that does not match exactly means the source is
+// compiled again, and the cache file is overwritten.
+
+static char *s_bytecode_dir;
+
+/// keep compiled bytecode for `llua_loadfile` in a directory.
+// A file is only compiled when its contents (or the Lua version) have
+// changed since it was cached; otherwise the bytecode is loaded.
+// Only use a directory which nobody else can write to, since Lua does
+// not check bytecode. NULL switches the cache off.
+// @within LoadingAndEvaluating
+void llua_bytecode_cache(const char *dir) {
+    free(s_bytecode_dir);
+    s_bytecode_dir = NULL;
+    if (dir) {
+        s_bytecode_dir = malloc(strlen(dir)+1);
+        strcpy(s_bytecode_dir,dir);
+    }
+}
+
+typedef struct {
+    char *buf;
+    size_t size, cap;
+} DumpBuf;
+
+static int dump_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+    DumpBuf *d = (DumpBuf*)ud;
+    if (d->size + sz > d->cap) {
+        d->cap = 2*(d->size + sz);
+        d->buf = realloc(d->buf,d->cap);
+    }
+    memcpy(d->buf + d->size,p,sz);
+    d->size += sz;
+    return 0;
+}
+
+// whole file in a malloc'd buffer, or NULL
+static char *read_all(const char *file, size_t *size) {
+    FILE *in = fopen(file,"rb");
+    if (! in)
+        return NULL;
+    size_t cap = 4096, n = 0, got;
+    char *buf = malloc(cap);
+    while ((got = fread(buf+n,1,cap-n,in)) > 0) {
+        n += got;
+        if (n == cap)
+            buf = realloc(buf,cap *= 2);
+    }
+    fclose(in);
+    *size = n;
+    return buf;
+}
+
+static unsigned long long fnv64(unsigned long long h, const char *p, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ (unsigned char)p[i]) * 1099511628211ULL;
+    return h;
+}
+
+// the compiled chunk is left on the stack; returns false if the cache can't help
+static bool load_cached(lua_State *L, const char *filename) {
+    size_t srclen, len;
+    char *src = read_all(filename,&srclen);
+    if (! src)
+        return false;
+    // the file name is part of the key, because it is part of the bytecode
+    unsigned long long h = fnv64(14695981039346656037ULL,LUA_RELEASE,strlen(LUA_RELEASE));
+    h = fnv64(h,filename,strlen(filename)+1);
+    unsigned long long hsrc = fnv64(14695981039346656037ULL,src,srclen);
+    free(src);
+
+    char path[1024], header[128], chunkname[1024];
+    snprintf(path,sizeof(path),"%s/%016llx.luac",s_bytecode_dir,h);
+    snprintf(chunkname,sizeof(chunkname),"@%s",filename);
+    int hlen = snprintf(header,sizeof(header),"llua %s %016llx %016llx ",LUA_RELEASE,h,hsrc);
+
+    char *cached = read_all(path,&len);
+    if (cached) {
+        char *nl = memchr(cached,'\n',len);
+        bool ok = false;
+        if (nl && nl - cached > hlen && memcmp(cached,header,hlen) == 0) {
+            char *code = nl + 1;
+            size_t clen = len - (code - cached);
+            if (strtoul(cached+hlen,NULL,10) == clen) {
+#if LUA_VERSION_NUM == 501
+                ok = luaL_loadbuffer(L,code,clen,chunkname) == 0;
+#else
+                ok = luaL_loadbufferx(L,code,clen,chunkname,"b") == LUA_OK;
+#endif
+                if (! ok) // the bytecode was not acceptable
+                    lua_pop(L,1);
+            }
+        }
+        free(cached);
+        if (ok)
+            return true;
+    }
+
+    // compile in the usual way, and write the bytecode for next time,
+    // replacing any stale bytecode for this file
+    if (luaL_loadfile(L,filename) != LUA_OK)
+        return true; // the error is our result
+    DumpBuf d = {NULL,0,0};
+#if LUA_VERSION_NUM < 503
+    lua_dump(L,dump_writer,&d);
+#else
+    lua_dump(L,dump_writer,&d,0);
+#endif
+    char tmp[1040];
+    snprintf(tmp,sizeof(tmp),"%s.tmp",path);
+    FILE *out = fopen(tmp,"wb");
+    if (out) {
+        bool ok = fprintf(out,"%s%lu\n",header,(unsigned long)d.size) > 0
+            && fwrite(d.buf,1,d.size,out) == d.size;
+        ok = fclose(out) == 0 && ok;
+        if (! ok || rename(tmp,path) != 0)
+            remove(tmp);
+    }
+    free(d.buf);
+    return true;
+}
+
 /// load a file and return the compiled chunk as a reference.
+// Uses the bytecode cache if `llua_bytecode_cache` has been called.
 // @within LoadingAndEvaluating
 llua_t *llua_loadfile(lua_State *L, const char *filename) {
-    int res = luaL_loadfile(L,filename);
+    int res;
+    if (s_bytecode_dir && load_cached(L,filename))
+        res = lua_isfunction(L,-1) ? LUA_OK : LUA_ERRSYNTAX;
+    else
+        res = luaL_loadfile(L,filename);
     if (res != LUA_OK) {
         return (llua_t*)l_error(L);
    }
@@ -194,7 +683,14 @@ llua_t *llua_loadfile(lua_State *L, const char *filename) {
 
 /// push the reference on the stack.
 lua_State *llua_push(llua_t *o) {
-    lua_rawgeti(o->L,LUA_REGISTRYINDEX,o->ref);
+    if (o->borrowed) {
+#ifdef DEBUG
+        assert(o->ref != 0 && "borrowed reference used after its scope ended");
+#endif
+        lua_pushvalue(o->L,o->ref);
+    } else {
+        lua_rawgeti(o->L,LUA_REGISTRYINDEX,o->ref);
+    }
     return o->L;
 }
 
@@ -257,17 +753,252 @@ char** llua_tostrarray(lua_State* L, int idx) {
     return res;
 }
 
+// the number at the top of the stack, if it is one
+static bool number_at_top(lua_State *L, lua_Number *x) {
+#if LUA_VERSION_NUM == 501
+    if (! lua_isnumber(L,-1))
+        return false;
+    *x = lua_tonumber(L,-1);
+    return true;
+#else
+    int isnum;
+    *x = lua_tonumberx(L,-1,&isnum);
+    return isnum;
+#endif
+}
+
+static bool int64_at_top(lua_State *L, int64 *x) {
+#if LUA_VERSION_NUM >= 503
+    int isnum;
+    *x = lua_tointegerx(L,-1,&isnum);
+    return isnum;
+#else
+    lua_Number d;
+    // (the range check comes first, and fails for NaN, since the cast is undefined otherwise)
+    if (! number_at_top(L,&d) || ! (d >= -9.2233720368547758e18 && d < 9.2233720368547758e18) || d != (int64)d)
+        return false;
+    *x = (int64)d;
+    return true;
+#endif
+}
+
+static int bulk_size(char kind) {
+    switch(kind) {
+    case 'i': return sizeof(int);
+    case 'l': return sizeof(int64);
+    case 'f': return sizeof(double);
+    case 'g': return sizeof(float);
+    case 'u': return 1;
+    case 'b': return sizeof(bool);
+    default: return 0;
+    }
+}
+
+// convert the elements in one pass with the kind switch outside the loop;
+// stops at the first bad element, leaving it on the stack
+#define BULK_LOOP(T,test,value) \
+    for (; i < n; i++) { \
+        lua_rawgeti(L,idx,i+1); \
+        if (! (test)) \
+            break; \
+        ((T*)buf)[i] = (value); \
+        lua_pop(L,1); \
+    }
+
+static err_t bulk_convert(lua_State *L, int idx, char kind, void *buf, int n) {
+    int i = 0;
+    lua_Number x;
+    int64 l;
+    const char *expected = NULL;
+    if (kind == 'u' && lua_type(L,idx) == LUA_TSTRING) { // bytes
+        memcpy(buf,lua_tostring(L,idx),n);
+        STAT_ADD(copies,1);
+        STAT_ADD(copied_bytes,n);
+        return NULL;
+    }
+    if (! lua_istable(L,idx))
+        return value_error("not a table");
+    switch(kind) {
+    case 'i':
+        BULK_LOOP(int,int64_at_top(L,&l) && l == (int)l,(int)l)
+        expected = "an int";
+        break;
+    case 'l':
+        BULK_LOOP(int64,int64_at_top(L,&l),l)
+        expected = "an integer";
+        break;
+    case 'f':
+        BULK_LOOP(double,number_at_top(L,&x),x)
+        expected = "a number";
+        break;
+    case 'g':
+        BULK_LOOP(float,number_at_top(L,&x),(float)x)
+        expected = "a number";
+        break;
+    case 'u':
+        BULK_LOOP(unsigned char,int64_at_top(L,&l) && l >= 0 && l <= 255,(unsigned char)l)
+        expected = "a byte";
+        break;
+    case 'b':
+        BULK_LOOP(bool,lua_type(L,-1) == LUA_TBOOLEAN,lua_toboolean(L,-1))
+        expected = "a boolean";
+        break;
+    default:
+        return value_error("unknown array type");
+    }
+    if (i == n) {
+        STAT_ADD(copies,1);
+        STAT_ADD(copied_bytes,n*bulk_size(kind));
+        return NULL;
+    }
+    char msg[128];
+    snprintf(msg,sizeof(msg),"element %d: expected %s, got %s",i+1,expected,luaL_typename(L,-1));
+    lua_pop(L,1);
+    return value_error(msg);
+}
+
+/// convert a Lua array into a buffer of C values.
+// `kind` is the element type:
+//
+//  * 'i' int
+//  * 'l' 64-bit integer (`int64`)
+//  * 'f' double
+//  * 'g' float
+//  * 'u' unsigned char (a Lua string is also accepted, as bytes)
+//  * 'b' bool
+//
+// `buf` has room for `size` elements (it may be a preallocated llib array)
+// and the number of elements is written to `len`, which may be NULL. Elements are
+// not coerced silently: the error names the first element of the wrong type,
+// and an integer kind does not accept numbers with a fractional part.
+// @within Converting
+// @usage err = llua_toarray_buf(L,-1,'g',positions,array_len(positions),&n);
+err_t llua_toarray_buf(lua_State *L, int idx, char kind, void *buf, int size, int *len) {
+    if (! bulk_size(kind))
+        return value_error("unknown element type");
+    int n = lua_rawlen(L,idx);
+    if (n > size)
+        return value_error("array is larger than the buffer");
+    if (len)
+        *len = n;
+    return bulk_convert(L,idx,kind,buf,n);
+}
+
+/// convert a Lua array into a new llib array of C values.
+// `kind` is as for `llua_toarray_buf`. Returns an error on the first bad element.
+// @within Converting
+// @usage int64 *ids = llua_toarray(L,-1,'l');
+void *llua_toarray(lua_State *L, int idx, char kind) {
+    int esize = bulk_size(kind);
+    if (! esize)
+        return value_error("unknown element type");
+    int n = lua_rawlen(L,idx);
+    void *res = NULL;
+    switch(kind) {
+    case 'i': res = array_new(int,n); break;
+    case 'l': res = array_new(int64,n); break;
+    case 'f': res = array_new(double,n); break;
+    case 'g': res = array_new(float,n); break;
+    case 'u': res = array_new(unsigned char,n); break;
+    case 'b': res = array_new(bool,n); break;
+    }
+    err_t err = bulk_convert(L,idx,kind,res,n);
+    if (err) {
+        obj_unref(res);
+        return (void*)err;
+    }
+    return res;
+}
+
+///// String views
+// A view points straight into a Lua string. Lua strings do not move, so
+// the view is good for as long as the string is reachable; the innermost
+// view scope keeps every viewed string in a table until it is released.
+
+typedef struct ViewScope_ {
+    lua_State *L;
+    int ref;    // the anchor table
+    int n;
+    struct ViewScope_ *prev;
+} ViewScope;
+
+static LLIB_TLS ViewScope *s_view_scope;
+
+static void view_scope_dispose(ViewScope *vs) {
+    luaL_unref(vs->L,LUA_REGISTRYINDEX,vs->ref);
+    // normally the innermost scope, but pools may release them in any order
+    ViewScope **pv = &s_view_scope;
+    while (*pv && *pv != vs)
+        pv = &(*pv)->prev;
+    if (*pv)
+        *pv = vs->prev;
+}
+
+/// start a scope for string views (the 'V' type specifier).
+// Strings viewed while this is the innermost scope stay valid until it is
+// released with `unref`, possibly by the enclosing object pool. Scopes are
+// per-thread, and views must come from states sharing `L`'s registry.
+// @within Converting
+// @usage void *scope = llua_view_scope(L);
+void *llua_view_scope(lua_State *L) {
+    ViewScope *vs = obj_new(ViewScope,view_scope_dispose);
+    vs->L = L;
+    lua_newtable(L);
+    vs->ref = luaL_ref(L,LUA_REGISTRYINDEX);
+    vs->n = 0;
+    vs->prev = s_view_scope;
+    s_view_scope = vs;
+    return vs;
+}
+
+static err_t string_view(lua_State *L, int idx, llua_view_t *view) {
+    size_t sz;
+    ViewScope *vs = s_view_scope;
+    if (! vs)
+        return "no view scope!";
+    view->str = lua_tolstring(L,idx,&sz);
+    view->len = sz;
+    lua_pushvalue(L,idx);
+    lua_rawgeti(L,LUA_REGISTRYINDEX,vs->ref);
+    lua_insert(L,-2);
+    lua_rawseti(L,-2,++vs->n);
+    lua_pop(L,1);
+    return NULL;
+}
+
+// copy a string into a caller's buffer, always nul-terminated.
+// If it doesn't fit, as much as fits is copied and `len` is still the full length.
+static err_t string_to_buf(lua_State *L, int idx, llua_buf_t *b) {
+    size_t sz, n;
+    const char *s = lua_tolstring(L,idx,&sz);
+    if (b->size <= 0)
+        return "no room in buffer!";
+    n = sz < (size_t)b->size ? sz : (size_t)b->size - 1;
+    memcpy(b->buf,s,n);
+    b->buf[n] = '\0';
+    b->len = sz;
+    return n < sz ? "string truncated!" : NULL;
+}
+
 static int is_indexable(lua_State *L, int idx) {
     return lua_istable(L,-1) || lua_isuserdata(L,-1);
 }
 
+// can we index the value at `idx` without raising an error?
+static bool can_index(lua_State *L, int idx) {
+    int t = lua_type(L,idx);
+    return t == LUA_TTABLE || t == LUA_TUSERDATA;
+}
+
 /// Read a value on the stack into a variable.
 // `kind` is a  _type specifier_
 //
 //  * 'i' integer
-//  * 'b' boolean
+//  * 'b' boolean (as `bool`)
 //  * 'f' double
 //  * 's' string
+//  * 'V' string view (as `llua_view_t`, see `llua_view_scope`)
+//  * 'B' string copied into a caller's buffer (as `llua_buf_t`)
 //  * 'o' object (as in `llua_to_obj`)
 //  * 'L' llua reference
 //  * 'I' array of integers
@@ -281,6 +1012,9 @@ err_t llua_convert(lua_State *L, char kind, void *P, int idx) {
     case 'i': // this is a tolerant operation; returns 0 if wrong type
         *((int*)P) =  lua_tointeger(L,idx);
         break;
+    case 'b': // as with Lua, anything not false or nil is true
+        *((bool*)P) = lua_toboolean(L,idx);
+        break;
     case 'f':
         if (! lua_isnumber(L,idx))
             err = "not a number!";
@@ -293,6 +1027,18 @@ err_t llua_convert(lua_State *L, char kind, void *P, int idx) {
         else
             *((char**)P) = string_copy(L,idx);
         break;
+    case 'V':
+        if (! lua_isstring(L,idx))
+            err = "not a string!";
+        else
+            err = string_view(L,idx,(llua_view_t*)P);
+        break;
+    case 'B':
+        if (! lua_isstring(L,idx))
+            err = "not a string!";
+        else
+            err = string_to_buf(L,idx,(llua_buf_t*)P);
+        break;
     case 'o':
         *((llua_t**)P) = llua_to_obj(L,idx);
         break;
@@ -350,89 +1096,312 @@ static err_t push_value(lua_State *L, char kind, void *data) {
     return NULL;
 }
 
-/// call the reference, passing a number of arguments.
-// These are specified by a set of _type specifiers_ `fmt`. Apart
-// from the usual ones, we have 'm' (which must be first) which
-// means "call the method by name" where `o` must be an object,
-// 'v' which means "push the value at the index", and 'x' which
-// means "C function".
-//
-// May optionally capture multiple return values with `llua_convert`.
-// There are some common cases that have symbolic names:
-//
-//  * `L_NONE` call doesn't return anything
-//  * `L_VAL`  we return a single value
-//  * `L_REF`  we always return result as a llua reference
-//  * `L_ERR`  Lua error convention, either <value> or <nil> <error-string>
+///// Profiling
+// When profiling is on, calls through `llua_callf` and `llua_sig_call` are
+// timed, and the times go into a histogram for each Lua function. The
+// buckets are logarithmic: each power of two is split into eight, so a
+// bucket is within 12.5% of the times in it.
 //
-// @within Calling
-// @usage llua_callf(strfind,"ss",str,";$","i",&i);
-// @usage llua_callf(open,"s","test.txt",L_ERR)
-// @usage llua_callf(file,"ms","write","hello there\n",L_NONE);
-void *llua_callf(llua_t *o, const char *fmt,...) {
-    lua_State *L = o->L;
-    int nargs = 0, nres = LUA_MULTRET, nerr;
-    err_t res = NULL;
-    char rtype;
-    va_list ap;
-    va_start(ap,fmt);
-    llua_push(o); // push the function or object
-    if (*fmt == 'm') { // method call!
-        const char *name = va_arg(ap,char*);
-        lua_getfield(L,-1,name);
-        // method at top, then self
-        lua_insert(L,-2);
-        ++fmt;
-        ++nargs;
+// A state finds its histograms in a weak-keyed table, from each function to
+// a userdata pointing to its histogram. When a function is collected, so is
+// its entry, and a new function at the same address gets a new histogram.
+// All histograms are on one list, so that any thread can report on them.
+// Only the thread running a state writes to its histograms; so a reset
+// just starts a new epoch, and each histogram is cleared by its writer once
+// it sees that (until then it is not reported). The histograms of collected
+// functions are reported until the next reset, which frees them.
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40    // about 18 minutes, in nanoseconds
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1)*HIST_SUB)
+
+typedef struct ProfHist_ {
+    struct ProfHist_ *next;
+    int epoch;
+    int dead;           // its function has been collected
+    char label[64];     // chunk name and line
+    int64 count, total, max;
+    int64 buckets[HIST_BUCKETS];
+} ProfHist;
+
+static int s_profiling;
+static ProfHist *s_hists;
+static int s_hists_lock, s_prof_epoch;
+static char prof_key;   // the state's table of histograms, in its registry
+
+static void prof_lock() {
+    int unlocked = 0;
+    while (! OBJ_ATOMIC_CAS(s_hists_lock,unlocked,1))
+        unlocked = 0;
+}
+
+static void prof_unlock() {
+    OBJ_ATOMIC_STORE(s_hists_lock,0);
+}
+
+static int64 prof_now() {
+#ifdef _WIN32
+    return (int64)((double)clock()/CLOCKS_PER_SEC*1e9);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (int64)ts.tv_sec*1000000000 + ts.tv_nsec;
+#endif
+}
+
+static int hist_bucket(int64 ns) {
+    int msb = 0;
+    if (ns < HIST_SUB)
+        return ns < 0 ? 0 : (int)ns;
+#ifdef __GNUC__
+    msb = 63 - __builtin_clzll((unsigned long long)ns);
+#else
+    for (int64 v = ns; v > 1; v >>= 1)
+        ++msb;
+#endif
+    if (msb >= HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+    int shift = msb - HIST_SUB_BITS;
+    return (shift + 1)*HIST_SUB + (int)((ns >> shift) & (HIST_SUB-1));
+}
+
+// the largest time that goes into a bucket
+static int64 hist_bucket_max(int idx) {
+    if (idx < HIST_SUB)
+        return idx;
+    int shift = idx/HIST_SUB - 1;
+    return (((int64)(HIST_SUB + idx%HIST_SUB) + 1) << shift) - 1;
+}
+
+static int prof_hist_gc(lua_State *L) {
+    ProfHist *h = *(ProfHist**)lua_touserdata(L,1);
+    OBJ_ATOMIC_STORE(h->dead,1);
+    return 0;
+}
+
+// the histogram of the function at `idx`, made and labelled the first time
+// if `make` is true; otherwise it may be NULL
+static ProfHist *prof_hist(lua_State *L, int idx, bool make) {
+    ProfHist *h = NULL;
+    if (idx < 0)
+        idx = lua_gettop(L) + idx + 1;
+    lua_pushlightuserdata(L,&prof_key);
+    lua_rawget(L,LUA_REGISTRYINDEX);
+    if (lua_isnil(L,-1)) {
+        lua_pop(L,1);
+        if (! make)
+            return NULL;
+        lua_newtable(L);
+        lua_newtable(L);
+        lua_pushstring(L,"k");
+        lua_setfield(L,-2,"__mode");
+        lua_setmetatable(L,-2);
+        lua_pushlightuserdata(L,&prof_key);
+        lua_pushvalue(L,-2);
+        lua_rawset(L,LUA_REGISTRYINDEX);
     }
-    // and push the arguments...
-    while (*fmt) {
-        switch(*fmt) {
-        case 'i':
-            lua_pushinteger(L, va_arg(ap,int));
-            break;
-        case 'v':
-            lua_pushvalue(L,va_arg(ap,int) - nargs - 1);
-            break;
-        case 'b':
-            lua_pushboolean(L, va_arg(ap,int));
-            break;
-        case 'f':
-            lua_pushnumber(L, va_arg(ap,double));
-            break;
-        default:
-            res = push_value(L,*fmt, va_arg(ap,void*));
-            if (res)
-                return (void*)llua_error(o,res);
-            break;
-        }
-        ++fmt;
-        ++nargs;
+    lua_pushvalue(L,idx);
+    lua_rawget(L,-2);
+    if (lua_touserdata(L,-1))
+        h = *(ProfHist**)lua_touserdata(L,-1);
+    lua_pop(L,1);
+    if (! h && make) {
+        h = calloc(1,sizeof(ProfHist));
+        h->epoch = OBJ_ATOMIC_LOAD(s_prof_epoch);
+        if (lua_isfunction(L,idx)) {
+            lua_Debug ar;
+            lua_pushvalue(L,idx);
+            lua_getinfo(L,">S",&ar);
+            snprintf(h->label,sizeof(h->label),"%s:%d",ar.short_src,ar.linedefined);
+        } else { // a callable object
+            snprintf(h->label,sizeof(h->label),"%s:%p",luaL_typename(L,idx),lua_topointer(L,idx));
+        }
+        lua_pushvalue(L,idx);
+        ProfHist **ph = (ProfHist**)lua_newuserdata(L,sizeof(ProfHist*));
+        *ph = h;
+        if (luaL_newmetatable(L,"llua.profile")) {
+            lua_pushcfunction(L,prof_hist_gc);
+            lua_setfield(L,-2,"__gc");
+        }
+        lua_setmetatable(L,-2);
+        lua_rawset(L,-3);
+        prof_lock();
+        h->next = s_hists;
+        s_hists = h;
+        prof_unlock();
     }
-    fmt = va_arg(ap,char*);
-    if (fmt) {
-        nres = strlen(fmt);
-        rtype = *(fmt+1);
-        if (*fmt == 'r' && rtype && rtype != 'E') // single return with explicit type
-            nres = 1;
+    lua_pop(L,1);
+    return h;
+}
+
+static void prof_add(ProfHist *h, int64 ns) {
+    int epoch = OBJ_ATOMIC_LOAD(s_prof_epoch);
+    if (h->epoch != epoch) { // there was a reset since the last call
+        OBJ_ATOMIC_STORE(h->count,0);
+        OBJ_ATOMIC_STORE(h->total,0);
+        OBJ_ATOMIC_STORE(h->max,0);
+        for (int i = 0; i < HIST_BUCKETS; i++)
+            OBJ_ATOMIC_STORE(h->buckets[i],0);
+        OBJ_ATOMIC_STORE(h->epoch,epoch);
     }
-    nerr = lua_pcall(L,nargs,nres,0);
-    if (nerr != LUA_OK) {
-        res = l_error(L);
+    OBJ_LOCAL_ADD(h->count,1);
+    OBJ_LOCAL_ADD(h->total,ns);
+    if (ns > h->max)
+        OBJ_ATOMIC_STORE(h->max,ns);
+    OBJ_LOCAL_ADD(h->buckets[hist_bucket(ns)],1);
+}
+
+/// switch timing of calls on or off, in all threads.
+// @within Profiling
+void llua_profile(bool on) {
+    OBJ_ATOMIC_STORE(s_profiling,on);
+}
+
+/// clear all the histograms, say at the start of a reporting interval.
+// Can be called from any thread.
+// @within Profiling
+void llua_profile_reset() {
+    prof_lock();
+    OBJ_ATOMIC_ADD(s_prof_epoch,1);
+    ProfHist **ph = &s_hists;
+    while (*ph) {
+        ProfHist *h = *ph;
+        if (OBJ_ATOMIC_LOAD(h->dead)) {
+            *ph = h->next;
+            free(h);
+        } else {
+            ph = &h->next;
+        }
+    }
+    prof_unlock();
+}
+
+// a copy of a histogram, or false if nothing was added since the last reset
+static bool hist_snapshot(ProfHist *h, ProfHist *snap) {
+    if (OBJ_ATOMIC_LOAD(h->epoch) != OBJ_ATOMIC_LOAD(s_prof_epoch))
+        return false;
+    snap->count = OBJ_ATOMIC_LOAD(h->count);
+    if (snap->count == 0)
+        return false;
+    snap->total = OBJ_ATOMIC_LOAD(h->total);
+    snap->max = OBJ_ATOMIC_LOAD(h->max);
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        snap->buckets[i] = OBJ_ATOMIC_LOAD(h->buckets[i]);
+    return true;
+}
+
+static int64 hist_percentile(ProfHist *h, double pct) {
+    int64 rank = (int64)(pct/100*h->count + 0.5), seen = 0;
+    if (rank < 1)
+        rank = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            int64 top = hist_bucket_max(i);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+static void hist_entry(ProfHist *h, ProfHist *snap, llua_profile_t *e) {
+    e->label = h->label;
+    e->count = snap->count;
+    e->mean = (double)snap->total/snap->count;
+    e->p50 = hist_percentile(snap,50);
+    e->p90 = hist_percentile(snap,90);
+    e->p99 = hist_percentile(snap,99);
+    e->p999 = hist_percentile(snap,99.9);
+    e->max = snap->max;
+}
+
+/// latencies of calls to a function, in nanoseconds.
+// Returns false if it has not been called since profiling was switched on,
+// or since the last reset.
+// Times are at most 12.5% over, except `mean` and `max`, which are exact.
+// @within Profiling
+bool llua_profile_get(llua_t *fn, llua_profile_t *e) {
+    ProfHist snap;
+    lua_State *L = llua_push(fn);
+    ProfHist *h = prof_hist(L,-1,false);
+    lua_pop(L,1);
+    if (! h || ! hist_snapshot(h,&snap))
+        return false;
+    hist_entry(h,&snap,e);
+    return true;
+}
+
+/// latencies of all functions called since the last reset, in all threads.
+// Fills up to `n` entries, and returns how many there are altogether.
+// Each state has its own entries. The labels belong to the profiler, and
+// last until the next reset.
+// @within Profiling
+int llua_profile_report(llua_profile_t *entries, int n) {
+    int k = 0;
+    ProfHist snap;
+    prof_lock();
+    for (ProfHist *h = s_hists; h; h = h->next) {
+        if (hist_snapshot(h,&snap)) {
+            if (k < n)
+                hist_entry(h,&snap,&entries[k]);
+            ++k;
+        }
+    }
+    prof_unlock();
+    return k;
+}
+
+// push the next argument of type `kind`; `nargs` is the number of
+// arguments already pushed, which matters for 'v'.
+static err_t push_arg(lua_State *L, char kind, va_list *ap, int nargs) {
+    switch(kind) {
+    case 'i':
+        lua_pushinteger(L, va_arg(*ap,int));
+        break;
+    case 'v':
+        lua_pushvalue(L,va_arg(*ap,int) - nargs - 1);
+        break;
+    case 'b':
+        lua_pushboolean(L, va_arg(*ap,int));
+        break;
+    case 'f':
+        lua_pushnumber(L, va_arg(*ap,double));
+        break;
+    default:
+        return push_value(L,kind,va_arg(*ap,void*));
     }
+    return NULL;
+}
+
+// how many values we ask lua_pcall for, given the return type specifiers
+static int return_count(const char *fmt) {
+    if (! fmt)
+        return LUA_MULTRET;
+    if (*fmt == 'r' && fmt[1] && fmt[1] != 'E') // single return with explicit type
+        return 1;
+    return strlen(fmt);
+}
+
+// Lua error return convention is object or nil,error-string
+static void *pop_error_convention(lua_State *L) {
+    void *val = llua_to_obj(L,-2);
+    if (! val)
+        val = value_error(lua_isstring(L,-1) ? lua_tostring(L,-1) : "nil");
+    lua_pop(L,2);
+    return val;
+}
+
+// pick up the results of a call, according to the return type specifiers
+static void *pop_returns(llua_t *o, err_t res, const char *fmt, int nres, va_list *ap) {
+    lua_State *L = o->L;
     if (nres == LUA_MULTRET || res != NULL) { // leave results on stack, or error!
         return (void*)llua_error(o,res);
     } else
     if (*fmt == 'r') { // return one value as object...
+        char rtype = fmt[1];
         if (rtype == 'E') {
-            // Lua error return convention is object
-            // or nil,error-string
-            void *val = llua_to_obj(L,-2);
-            void *err = llua_to_obj(L,-1);
-            if (! val)
-                val = value_error(err);
-            lua_pop(L,2);
-            return val;
+            return pop_error_convention(L);
         } else
         if (rtype) { // force the type!
             void *value;
@@ -445,11 +1414,10 @@ void *llua_callf(llua_t *o, const char *fmt,...) {
         } else {
             return llua_to_obj_pop(L,-1);
         }
-    } else
-    if (nres != LUA_MULTRET) {
+    } else {
         int idx = -nres;
         while (*fmt) {
-            res = llua_convert(L,*fmt,va_arg(ap,void*),idx);
+            res = llua_convert(L,*fmt,va_arg(*ap,void*),idx);
             if (res) // conversion error!
                 break;
             ++fmt;
@@ -457,10 +1425,354 @@ void *llua_callf(llua_t *o, const char *fmt,...) {
         }
         lua_pop(L,nres);
     }
-    va_end(ap);
     return (void*)res;
 }
 
+/// call the reference, passing a number of arguments.
+// These are specified by a set of _type specifiers_ `fmt`. Apart
+// from the usual ones, we have 'm' (which must be first) which
+// means "call the method by name" where `o` must be an object,
+// 'v' which means "push the value at the index", and 'x' which
+// means "C function".
+//
+// May optionally capture multiple return values with `llua_convert`.
+// There are some common cases that have symbolic names:
+//
+//  * `L_NONE` call doesn't return anything
+//  * `L_VAL`  we return a single value
+//  * `L_REF`  we always return result as a llua reference
+//  * `L_ERR`  Lua error convention, either <value> or <nil> <error-string>
+//
+// @within Calling
+// @usage llua_callf(strfind,"ss",str,";$","i",&i);
+// @usage llua_callf(open,"s","test.txt",L_ERR)
+// @usage llua_callf(file,"ms","write","hello there\n",L_NONE);
+void *llua_callf(llua_t *o, const char *fmt,...) {
+    lua_State *L = o->L;
+    int nargs = 0, nres, nerr;
+    err_t res = NULL;
+    void *ret;
+    va_list ap;
+    va_start(ap,fmt);
+    int top = lua_gettop(L);
+    llua_push(o); // push the function or object
+    if (*fmt == 'm') { // method call!
+        const char *name = va_arg(ap,char*);
+        lua_getfield(L,-1,name);
+        // method at top, then self
+        lua_insert(L,-2);
+        ++fmt;
+        ++nargs;
+    }
+    // and push the arguments...
+    while (*fmt) {
+        res = push_arg(L,*fmt,&ap,nargs);
+        if (res) {
+            lua_settop(L,top);
+            va_end(ap);
+            return (void*)llua_error(o,res);
+        }
+        ++fmt;
+        ++nargs;
+    }
+    fmt = va_arg(ap,char*);
+    nres = return_count(fmt);
+    if (OBJ_ATOMIC_LOAD(s_profiling)) {
+        ProfHist *h = prof_hist(L,-nargs-1,true);
+        int64 t0 = prof_now();
+        nerr = lua_pcall(L,nargs,nres,0);
+        prof_add(h,prof_now() - t0);
+    } else {
+        nerr = lua_pcall(L,nargs,nres,0);
+    }
+    STAT_ADD(calls,1);
+    if (nerr != LUA_OK) {
+        STAT_ADD(call_errors,1);
+        res = l_error(L);
+    }
+    ret = pop_returns(o,res,fmt,nres,&ap);
+    va_end(ap);
+    return ret;
+}
+
+// A signature is decoded once into a plan: one code per argument, and one
+// per result for a list of results, so that a call is a loop of typed pushes
+// and pops. Results of other kinds go through `llua_convert`.
+enum {
+    SIG_INT, SIG_BOOL, SIG_FLOAT, SIG_VALUE, SIG_STRING, SIG_OBJ, SIG_CFUNC, SIG_PTR,
+    SIG_CONVERT
+};
+
+// how the results come back
+enum {
+    SIG_RET_STACK,  // left on the stack (no return specifiers)
+    SIG_RET_OBJ,    // 'r': one value as an object
+    SIG_RET_TYPED,  // 'rX': one value of type X
+    SIG_RET_ERR,    // 'rE': value, or nil plus error
+    SIG_RET_LIST    // through pointers
+};
+
+static void llua_sig_dispose(llua_sig_t *s) {
+    obj_unref(s->fn);
+    obj_unref(s->args);
+    obj_unref(s->rets);
+    obj_unref(s->plan);
+}
+
+#define ARG_KINDS "ibfvsoxp"
+#define RET_KINDS "ibfsVBoLIFS"
+
+static int arg_code(char kind) {
+    switch(kind) {
+    case 'i': return SIG_INT;
+    case 'b': return SIG_BOOL;
+    case 'f': return SIG_FLOAT;
+    case 'v': return SIG_VALUE;
+    case 's': return SIG_STRING;
+    case 'o': return SIG_OBJ;
+    case 'x': return SIG_CFUNC;
+    default: return SIG_PTR;
+    }
+}
+
+static int ret_code(char kind) {
+    switch(kind) {
+    case 'i': return SIG_INT;
+    case 'b': return SIG_BOOL;
+    case 'f': return SIG_FLOAT;
+    default: return SIG_CONVERT;
+    }
+}
+
+/// prepare a call signature for repeated calls of a reference.
+// `args` and `rets` are the argument and return type specifiers,
+// exactly as with `llua_callf`, except that the returns are fixed
+// up front. These are checked and decoded once, so that
+// `llua_sig_call` only has to push, call and store.
+// `rets` may be NULL, meaning 'leave all results on the stack'.
+// Returns an error if the specifiers are not valid.
+// @within Calling
+// @usage llua_sig_t *find = llua_sig_new(strfind,"ssi","ii");
+llua_sig_t *llua_sig_new(llua_t *o, const char *args, const char *rets) {
+    llua_sig_t *s;
+    const char *p = args;
+    if (*p == 'm')
+        ++p;
+    for (; *p; ++p) {
+        if (! strchr(ARG_KINDS,*p))
+            return (llua_sig_t*)value_error("unknown argument type");
+    }
+    if (rets) {
+        p = rets;
+        if (*p == 'r') {
+            if (p[1] && ! (p[1] == 'E' || strchr(RET_KINDS,p[1])))
+                return (llua_sig_t*)value_error("unknown return type");
+        } else {
+            for (; *p; ++p) {
+                if (! strchr(RET_KINDS,*p))
+                    return (llua_sig_t*)value_error("unknown return type");
+            }
+        }
+    }
+    s = obj_new(llua_sig_t,llua_sig_dispose);
+    s->fn = llua_hold(o);
+    s->method = *args == 'm';
+    obj_pool_suspend(); // the parts belong to the signature
+    s->args = str_new(s->method ? args+1 : args);
+    s->rets = rets ? str_new(rets) : NULL;
+    s->plan = array_new(unsigned char,strlen(s->args) + (rets ? strlen(rets) : 0));
+    obj_pool_resume();
+    s->nargs = array_len(s->args) + (s->method ? 1 : 0);
+    s->nres = return_count(rets);
+    for (int k = 0; s->args[k]; k++)
+        s->plan[k] = arg_code(s->args[k]);
+    if (! rets)
+        s->ret_mode = SIG_RET_STACK;
+    else if (*rets != 'r')
+        s->ret_mode = SIG_RET_LIST;
+    else if (! rets[1])
+        s->ret_mode = SIG_RET_OBJ;
+    else
+        s->ret_mode = rets[1] == 'E' ? SIG_RET_ERR : SIG_RET_TYPED;
+    if (s->ret_mode == SIG_RET_LIST) {
+        unsigned char *rp = s->plan + array_len(s->args);
+        for (int k = 0; rets[k]; k++)
+            rp[k] = ret_code(rets[k]);
+    }
+    return s;
+}
+
+// store the results of a signature call through the pointers in `ap`
+static err_t sig_store(llua_sig_t *s, va_list *ap) {
+    lua_State *L = s->fn->L;
+    const unsigned char *rp = s->plan + array_len(s->args);
+    err_t err = NULL;
+    for (int k = 0, idx = -s->nres; k < s->nres && ! err; k++, idx++) {
+        void *P = va_arg(*ap,void*);
+        switch(rp[k]) {
+        case SIG_INT:
+            *(int*)P = lua_tointeger(L,idx);
+            break;
+        case SIG_BOOL:
+            *(bool*)P = lua_toboolean(L,idx);
+            break;
+        case SIG_FLOAT:
+            if (lua_isnumber(L,idx)) {
+                *(double*)P = lua_tonumber(L,idx);
+                break;
+            } // otherwise, let llua_convert report it
+        default:
+            err = llua_convert(L,s->rets[k],P,idx);
+            break;
+        }
+    }
+    lua_pop(L,s->nres);
+    return err;
+}
+
+/// call a prepared signature.
+// The arguments follow the `args` of `llua_sig_new`, and then the
+// pointers for any returned values, as with `llua_callf`.
+// @within Calling
+// @usage llua_sig_call(find,"hello dolly","doll",1,&i1,&i2);
+void *llua_sig_call(llua_sig_t *s, ...) {
+    llua_t *o = s->fn;
+    lua_State *L = o->L;
+    const unsigned char *op = s->plan;
+    int nargs = 0, nerr;
+    err_t res = NULL;
+    void *ret = NULL;
+    va_list ap;
+    va_start(ap,s);
+    llua_push(o);
+    if (s->method) {
+        lua_getfield(L,-1,va_arg(ap,char*));
+        lua_insert(L,-2);
+        ++nargs;
+    }
+    for (; nargs < s->nargs; ++nargs, ++op) {
+        switch(*op) {
+        case SIG_INT:
+            lua_pushinteger(L,va_arg(ap,int));
+            break;
+        case SIG_BOOL:
+            lua_pushboolean(L,va_arg(ap,int));
+            break;
+        case SIG_FLOAT:
+            lua_pushnumber(L,va_arg(ap,double));
+            break;
+        case SIG_VALUE:
+            lua_pushvalue(L,va_arg(ap,int) - nargs - 1);
+            break;
+        case SIG_STRING:
+            lua_pushstring(L,va_arg(ap,const char*));
+            break;
+        case SIG_OBJ:
+            llua_push(va_arg(ap,llua_t*));
+            break;
+        case SIG_CFUNC:
+            lua_pushcfunction(L,va_arg(ap,lua_CFunction));
+            break;
+        default:
+            lua_pushlightuserdata(L,va_arg(ap,void*));
+            break;
+        }
+    }
+    STAT_ADD(calls,1);
+    if (OBJ_ATOMIC_LOAD(s_profiling)) {
+        ProfHist *h = prof_hist(L,-s->nargs-1,true);
+        int64 t0 = prof_now();
+        nerr = lua_pcall(L,s->nargs,s->nres,0);
+        prof_add(h,prof_now() - t0);
+    } else {
+        nerr = lua_pcall(L,s->nargs,s->nres,0);
+    }
+    if (nerr != LUA_OK) {
+        STAT_ADD(call_errors,1);
+        res = l_error(L);
+    }
+    if (res || s->ret_mode == SIG_RET_STACK) {
+        ret = (void*)llua_error(o,res);
+    } else {
+        switch(s->ret_mode) {
+        case SIG_RET_LIST:
+            ret = (void*)llua_error(o,sig_store(s,&ap));
+            break;
+        case SIG_RET_OBJ:
+            ret = llua_to_obj_pop(L,-1);
+            break;
+        case SIG_RET_ERR:
+            ret = pop_error_convention(L);
+            break;
+        default: // SIG_RET_TYPED
+            res = llua_convert(L,s->rets[1],&ret,-1);
+            lua_pop(L,1);
+            if (res)
+                ret = (void*)llua_error(o,res);
+            break;
+        }
+    }
+    va_end(ap);
+    return ret;
+}
+
+/// prepare an expression with typed parameters for repeated evaluation.
+// `params` is a comma-separated list of `name:type`, where the types are
+// argument type specifiers. The expression is compiled once as a function
+// of these parameters, and `rets` is as for `llua_sig_new`. If `expr` is not
+// an expression, it is taken to be a chunk which returns its own results.
+// The result is a call signature, so evaluate it with `llua_sig_call`.
+// @within Calling
+// @usage llua_sig_t *f = llua_prepare(L,"x*y + z","x:f,y:f,z:f","f");
+// @usage llua_sig_call(f,1.5,2.0,1.0,&res);
+llua_sig_t *llua_prepare(lua_State *L, const char *expr, const char *params, const char *rets) {
+    char *names = str_new_size(strlen(params)); // never longer than params
+    char *kinds = str_new_size(strlen(params));
+    char *pn = names, *pk = kinds;
+    const char *p = params;
+    err_t err = NULL;
+    while (*p) {
+        const char *start = p;
+        while (*p == '_' || isalnum((unsigned char)*p))
+            ++p;
+        if (p == start || isdigit((unsigned char)*start) || *p != ':' || ! p[1]
+                || ! strchr(ARG_KINDS,p[1]) || (p[2] && p[2] != ',')) {
+            err = value_error("bad parameter: expecting name:type");
+            break;
+        }
+        if (pn != names)
+            *pn++ = ',';
+        memcpy(pn,start,p - start);
+        pn += p - start;
+        *pk++ = p[1];
+        p += 2;
+        if (*p == ',')
+            ++p;
+    }
+    *pn = '\0';
+    *pk = '\0';
+    llua_sig_t *s = (llua_sig_t*)err;
+    if (! err) {
+        const char *fmt = *names ? "local %s = ...; %s%s" : "%s%s%s";
+        int size = strlen(names) + strlen(expr) + 32;
+        char *code = str_new_size(size);
+        snprintf(code,size,fmt,names,"return ",expr);
+        llua_t *fn = llua_load(L,code,"prepared");
+        if (value_is_error(fn)) { // not an expression, so try a chunk
+            obj_unref(fn);
+            snprintf(code,size,fmt,names,"",expr);
+            fn = llua_load(L,code,"prepared");
+        }
+        s = value_is_error(fn) ? (llua_sig_t*)fn : llua_sig_new(fn,kinds,rets);
+        if (! value_is_error(fn))
+            obj_unref(fn);
+        obj_unref(code);
+    }
+    obj_unref(names);
+    obj_unref(kinds);
+    return s;
+}
+
 /// call a function, raising an error.
 // A useful combination of `llua_callf` and `llua_assert`
 // @function llua_call_or_die
@@ -631,75 +1943,1077 @@ void *llua_rawgeti(llua_t* o, int key) {
     return llua_to_obj_pop(L,-1);
 }
 
-/// push an llib object.
-// equivalent to `llua_push` if it's a llua ref, otherwise
-// uses llib type. If there's no type it assumes a plain
-// string literal.
-void llua_push_object(lua_State *L, void *value) {
-    if (llua_is_lua_object((llua_t*)value)) {
-        llua_push((llua_t*)value);
-    }  else
-    if (value_is_float(value)) {
-        lua_pushnumber(L,value_as_float(value));
-    } else
-    if (value_is_string(value)) {
-        lua_pushstring(L,(const char*)value);
-    } else
-    if (value_is_int(value)) {
-        lua_pushnumber(L,value_as_int(value));
-    } else
-    if (value_is_bool(value)) {
-        lua_pushboolean(L,value_as_bool(value));
-    }  else { // _probably_ a string. You have been warned...
-        lua_pushstring(L,(const char*)value);
-    }
+/// index the reference with a string key, converting to a type.
+// `kind` is a type specifier as with `llua_convert`. Scalars ('i','f','b')
+// are stored directly, so nothing is allocated.
+// @within GettingAndSetting
+// @usage llua_gets_as(T,"width","f",&width);
+err_t llua_gets_as(llua_t *o, const char *key, char kind, void *P) {
+    lua_State *L = llua_push(o);
+    err_t err;
+    safe_gets(L,key);
+    err = llua_convert(L,kind,P,-1);
+    lua_pop(L,2);
+    return llua_error(o,err);
 }
 
-/// set value using integer key.
-// uses `llua_push_object`
+/// index the reference with an integer key, converting to a type.
+// Like `llua_gets_as`.
 // @within GettingAndSetting
-void llua_seti(llua_t *o, int key, void *value) {
+err_t llua_geti_as(llua_t *o, int key, char kind, void *P) {
     lua_State *L = llua_push(o);
+    err_t err;
     lua_pushinteger(L,key);
-    llua_push_object(L,value);
-    lua_settable(L,-3);
+    lua_gettable(L,-2);
+    err = llua_convert(L,kind,P,-1);
+    lua_pop(L,2);
+    return llua_error(o,err);
 }
-/// set value using integer key.
-// uses `llua_push_object`
+
+/// an interned key for repeated table access.
+// The key is a Lua string held as a reference, so using it costs one registry
+// fetch rather than hashing and looking up a C string. For tables on the stack,
+// push it with `llua_push` and use `lua_gettable` or `lua_settable`.
 // @within GettingAndSetting
-void llua_sets(llua_t *o, const char *key, void *value) {
+// @usage llua_key_t *price = llua_key(L,"price");
+llua_key_t *llua_key(lua_State *L, const char *name) {
+    lua_pushstring(L,name);
+    llua_key_t *key = llua_new(L,-1);
+    lua_pop(L,1);
+    return key;
+}
+
+/// index the reference with an interned key, returning an object.
+// @within GettingAndSetting
+void *llua_getk(llua_t *o, llua_key_t *key) {
     lua_State *L = llua_push(o);
-    llua_push_object(L,value);
-    lua_setfield(o->L,-2,key);
+    llua_push(key);
+    lua_gettable(L,-2);
+    lua_remove(L,-2);
+    return llua_to_obj_pop(L,-1);
 }
 
-// there's some code duplication here with llua_callf, but I'm not
-// 100% sure how far to push <stdarg.h>!
+/// index the reference with an interned key, converting with a type specifier.
+// @within GettingAndSetting
+err_t llua_getk_as(llua_t *o, llua_key_t *key, char kind, void *P) {
+    lua_State *L = llua_push(o);
+    err_t err;
+    llua_push(key);
+    lua_gettable(L,-2);
+    err = llua_convert(L,kind,P,-1);
+    lua_pop(L,2);
+    return llua_error(o,err);
+}
 
-/// set multiple keys and values on the reference.
-// uses type specifiers like `llua_callf`
+/// set a value using an interned key.
 // @within GettingAndSetting
-err_t llua_sets_v(llua_t *o, const char *key,...) {
+void llua_setk(llua_t *o, llua_key_t *key, void *value) {
     lua_State *L = llua_push(o);
-    const char *fmt;
-    err_t err = NULL;
-    va_list ap;
-    va_start(ap,key);
-    while (key) { // key followed by type specifier and pointer-to-data
-        fmt = va_arg(ap,const char*);
-        switch(*fmt) {
-        case 'i':
-            lua_pushinteger(L, va_arg(ap,int));
-            break;
-        case 'b':
-            lua_pushboolean(L, va_arg(ap,int));
-            break;
-        case 'f':
-            lua_pushnumber(L, va_arg(ap,double));
-            break;
-        default:
-            err = push_value(L,*fmt,va_arg(ap,void*));
-            break;
+    llua_push(key);
+    llua_push_object(L,value);
+    lua_settable(L,-3);
+    lua_pop(L,1);
+}
+
+///// Coroutine scheduler
+// Functions run as coroutines, and wait by yielding a reason. "sleep" is
+// handled here with a timer wheel; any other reason is handed to the
+// `on_wait` callback, and the task stays parked until `llua_sched_resume`.
+// Threads are kept in a Lua table by slot and reused once their task
+// finishes, so a long-running scheduler doesn't create a thread per task.
+
+#define SCHED_WHEEL 256
+
+enum { TASK_FREE, TASK_RUNNING, TASK_SLEEPING, TASK_WAITING };
+
+typedef struct {
+    lua_State *co;  // NULL until the slot first gets a thread
+    int next;       // in a wheel slot, or the free list
+    int rounds;     // turns of the wheel left before waking
+    int nres;       // values a yield left on the thread's stack
+    uint32 gen;
+    unsigned char state;
+} SchedTask;
+
+struct LLuaSched_ {
+    lua_State *L;
+    int ref;        // the table of threads
+    SchedTask *tasks;
+    int cap, live, free;
+    int sleeping;   // tasks on the wheel
+    int wheel[SCHED_WHEEL];
+    int tick_ms;
+    int64 tick, base;
+    bool started;
+    llua_wait_fn on_wait;
+    void *data;
+};
+
+// the resume signature changes in 5.2 (`from`) and 5.4 (`nres`)
+static int sched_resume(lua_State *co, lua_State *from, int nargs, int *nres) {
+#if LUA_VERSION_NUM == 501
+    int status = lua_resume(co,nargs);
+    *nres = lua_gettop(co);
+    return status;
+#elif LUA_VERSION_NUM < 504
+    int status = lua_resume(co,from,nargs);
+    *nres = lua_gettop(co);
+    return status;
+#else
+    return lua_resume(co,from,nargs,nres);
+#endif
+}
+
+static void sched_dispose(llua_sched_t *S) {
+    luaL_unref(S->L,LUA_REGISTRYINDEX,S->ref);
+    free(S->tasks);
+}
+
+/// a scheduler for coroutines, with timers of `tick_ms` resolution.
+// `on_wait` (which may be NULL) is called with the task, the reason and
+// the thread when a task yields a reason other than "sleep"; the other
+// yielded values are the top `nargs` values on the thread's stack. It is
+// also called with "done" and the results when a task finishes, and with
+// "error" and the message when it fails. `data` is for the callback.
+// @within Coroutines
+llua_sched_t *llua_sched_new(lua_State *L, int tick_ms, llua_wait_fn on_wait, void *data) {
+    llua_sched_t *S = obj_new(llua_sched_t,sched_dispose);
+    S->L = L;
+    lua_newtable(L);
+    S->ref = luaL_ref(L,LUA_REGISTRYINDEX);
+    S->tasks = NULL;
+    S->cap = S->live = S->sleeping = 0;
+    S->free = -1;
+    for (int i = 0; i < SCHED_WHEEL; i++)
+        S->wheel[i] = -1;
+    S->tick_ms = tick_ms > 0 ? tick_ms : 1;
+    S->tick = S->base = 0;
+    S->started = false;
+    S->on_wait = on_wait;
+    S->data = data;
+    return S;
+}
+
+/// the `data` passed to `llua_sched_new`.
+// @within Coroutines
+void *llua_sched_data(llua_sched_t *S) {
+    return S->data;
+}
+
+/// number of tasks which have not finished.
+// @within Coroutines
+int llua_sched_count(llua_sched_t *S) {
+    return S->live;
+}
+
+static llua_task_t task_id(llua_sched_t *S, int k) {
+    return HANDLE_MAKE(S->tasks[k].gen,k);
+}
+
+static int task_slot(llua_sched_t *S, llua_task_t task) {
+    int k = handle_index(task);
+    if (k < 0 || k >= S->cap || S->tasks[k].state == TASK_FREE || S->tasks[k].gen != HANDLE_GEN(task))
+        return -1;
+    return k;
+}
+
+// a free slot with a thread ready to go
+static int task_new(llua_sched_t *S) {
+    lua_State *L = S->L;
+    int k = S->free;
+    if (k == -1) {
+        int cap = S->cap ? 2*S->cap : 16;
+        if (cap > HANDLE_MAX_SLOTS)
+            return -1;
+        S->tasks = realloc(S->tasks,cap*sizeof(SchedTask));
+        for (int i = cap - 1; i >= S->cap; i--) {
+            SchedTask *t = &S->tasks[i];
+            t->co = NULL;
+            t->gen = 0;
+            t->state = TASK_FREE;
+            t->next = S->free;
+            S->free = i;
+        }
+        S->cap = cap;
+        k = S->free;
+    }
+    SchedTask *t = &S->tasks[k];
+    S->free = t->next;
+    if (! t->co) {
+        lua_rawgeti(L,LUA_REGISTRYINDEX,S->ref);
+        t->co = lua_newthread(L);
+        lua_rawseti(L,-2,k+1);
+        lua_pop(L,1);
+    }
+    t->state = TASK_RUNNING;
+    t->nres = 0;
+    ++S->live;
+    return k;
+}
+
+static void task_free(llua_sched_t *S, int k, bool keep_thread) {
+    SchedTask *t = &S->tasks[k];
+    if (keep_thread) {
+        lua_settop(t->co,0);
+    } else { // a thread which failed can't be resumed again
+        lua_rawgeti(S->L,LUA_REGISTRYINDEX,S->ref);
+        lua_pushnil(S->L);
+        lua_rawseti(S->L,-2,k+1);
+        lua_pop(S->L,1);
+        t->co = NULL;
+    }
+    t->state = TASK_FREE;
+    --S->live;
+    // like handles, a slot which has used up its generations is retired
+    if (++t->gen == HANDLE_GEN_RETIRED)
+        return;
+    t->next = S->free;
+    S->free = k;
+}
+
+static void task_sleep(llua_sched_t *S, int k, double ms) {
+    SchedTask *t = &S->tasks[k];
+    int64 ticks = ms > 0 ? (int64)((ms + S->tick_ms - 1)/S->tick_ms) : 0;
+    if (ticks < 1)
+        ticks = 1;
+    int slot = (int)((S->tick + ticks) % SCHED_WHEEL);
+    t->rounds = (int)((ticks - 1)/SCHED_WHEEL);
+    t->state = TASK_SLEEPING;
+    t->next = S->wheel[slot];
+    S->wheel[slot] = k;
+    ++S->sleeping;
+}
+
+// the fewest turns of the wheel any sleeping task has left
+static int sched_min_rounds(llua_sched_t *S) {
+    int least = INT_MAX;
+    for (int slot = 0; slot < SCHED_WHEEL; slot++)
+        for (int k = S->wheel[slot]; k != -1; k = S->tasks[k].next)
+            if (S->tasks[k].rounds < least)
+                least = S->tasks[k].rounds;
+    return least;
+}
+
+// push `fmt` arguments onto the main state and move them to the thread
+static err_t task_args(llua_sched_t *S, lua_State *co, int nfn, const char *fmt, va_list *ap) {
+    lua_State *L = S->L;
+    int nargs = 0;
+    while (*fmt) {
+        err_t err = push_arg(L,*fmt,ap,nargs);
+        if (err) {
+            lua_pop(L,nargs + nfn);
+            return err;
+        }
+        ++fmt;
+        ++nargs;
+    }
+    lua_xmove(L,co,nargs + nfn);
+    return NULL;
+}
+
+// resume a task, and deal with how it stops
+static void task_step(llua_sched_t *S, int k, int nargs) {
+    lua_State *co = S->tasks[k].co;
+    llua_task_t id = task_id(S,k);
+    int nres, status, base;
+    const char *reason;
+    S->tasks[k].state = TASK_RUNNING;
+    status = sched_resume(co,S->L,nargs,&nres);
+    base = lua_gettop(co) - nres;
+    if (status == LUA_YIELD) {
+        reason = nres > 0 && lua_type(co,base+1) == LUA_TSTRING ? lua_tostring(co,base+1) : NULL;
+        if (! reason || strcmp(reason,"sleep") == 0) {
+            double ms = reason ? lua_tonumber(co,base+2) : 0;
+            lua_pop(co,nres);
+            task_sleep(S,k,ms);
+        } else {
+            S->tasks[k].nres = nres;
+            S->tasks[k].state = TASK_WAITING;
+            if (S->on_wait)
+                S->on_wait(S,id,reason,co,nres-1);
+        }
+    } else {
+        // the callback may well spawn tasks, so `tasks` can move
+        if (S->on_wait)
+            S->on_wait(S,id,status == LUA_OK ? "done" : "error",co,status == LUA_OK ? nres : 1);
+        task_free(S,k,status == LUA_OK);
+    }
+}
+
+/// start a function as a task.
+// The arguments follow `fmt` as for `llua_callf`. The task runs until it
+// first yields, so it may have finished by the time this returns.
+// Returns 0 if an argument could not be pushed.
+// @within Coroutines
+llua_task_t llua_sched_spawn(llua_sched_t *S, llua_t *fn, const char *fmt,...) {
+    int k = task_new(S), nargs = strlen(fmt);
+    llua_task_t id;
+    va_list ap;
+    if (k == -1)
+        return 0;
+    va_start(ap,fmt);
+    llua_push(fn);
+    err_t err = task_args(S,S->tasks[k].co,1,fmt,&ap);
+    va_end(ap);
+    if (err) {
+        task_free(S,k,true);
+        return 0;
+    }
+    id = task_id(S,k);
+    task_step(S,k,nargs);
+    return id;
+}
+
+/// resume a task which is waiting, with values for `coroutine.yield` to return.
+// Returns false if the task is not waiting (or has finished), or an
+// argument could not be pushed.
+// @within Coroutines
+bool llua_sched_resume(llua_sched_t *S, llua_task_t task, const char *fmt,...) {
+    int k = task_slot(S,task);
+    va_list ap;
+    if (k == -1 || S->tasks[k].state != TASK_WAITING)
+        return false;
+    lua_State *co = S->tasks[k].co;
+    lua_pop(co,S->tasks[k].nres);
+    S->tasks[k].nres = 0;
+    va_start(ap,fmt);
+    err_t err = task_args(S,co,0,fmt,&ap);
+    va_end(ap);
+    if (err)
+        return false;
+    task_step(S,k,strlen(fmt));
+    return true;
+}
+
+/// wake the tasks whose sleep is over at time `now` (in milliseconds).
+// Times are relative to the first call. Returns the number of tasks woken.
+// With nothing sleeping the clock just jumps to `now`, and whole turns of
+// the wheel in which no task can wake are skipped at once.
+// @within Coroutines
+int llua_sched_run(llua_sched_t *S, int64 now) {
+    int woken = 0;
+    if (! S->started) {
+        S->base = now;
+        S->started = true;
+    }
+    int64 target = (now - S->base)/S->tick_ms, check = S->tick;
+    while (S->tick < target) {
+        if (S->sleeping == 0) {
+            S->tick = target;
+            break;
+        }
+        // once a turn, which costs no more than the turn would have
+        if (S->tick >= check && target - S->tick > SCHED_WHEEL) {
+            int64 turns = (target - S->tick)/SCHED_WHEEL;
+            int least = sched_min_rounds(S);
+            if (turns > least)
+                turns = least;
+            if (turns > 0) {
+                for (int slot = 0; slot < SCHED_WHEEL; slot++)
+                    for (int k = S->wheel[slot]; k != -1; k = S->tasks[k].next)
+                        S->tasks[k].rounds -= (int)turns;
+                S->tick += turns*SCHED_WHEEL;
+            }
+            check = S->tick + SCHED_WHEEL;
+            continue;
+        }
+        int slot = (int)(++S->tick % SCHED_WHEEL);
+        int k = S->wheel[slot];
+        S->wheel[slot] = -1;
+        while (k != -1) {
+            SchedTask *t = &S->tasks[k];
+            int next = t->next;
+            if (t->rounds > 0) {
+                --t->rounds;
+                t->next = S->wheel[slot];
+                S->wheel[slot] = k;
+            } else {
+                --S->sleeping;
+                task_step(S,k,0);
+                ++woken;
+            }
+            k = next;
+        }
+    }
+    return woken;
+}
+
+///// Batch calls
+// Calling a function over columns of values: all the rows run inside one
+// protected call, with the function and the stack slots reused each time.
+// A row which raises an error is recorded, and the protected call is
+// restarted at the next row.
+
+typedef struct {
+    const char *args, *rets;
+    int nargs, nrets;
+    void **in, **out;   // the columns
+    int n, row, chunk;
+} Batch;
+
+// size of the C value written by llua_convert for a type specifier
+static int kind_size(char kind) {
+    switch(kind) {
+    case 'i': return sizeof(int);
+    case 'f': return sizeof(double);
+    case 'b': return sizeof(bool);
+    case 's': case 'o': case 'L': return sizeof(void*);
+    case 'V': return sizeof(llua_view_t);
+    default: return 0;
+    }
+}
+
+static void batch_push(lua_State *L, char kind, void *col, int r) {
+    switch(kind) {
+    case 'i': lua_pushinteger(L,((int*)col)[r]); break;
+    case 'f': lua_pushnumber(L,((double*)col)[r]); break;
+    case 'b': lua_pushboolean(L,((bool*)col)[r]); break;
+    case 's': {
+        const char *s = ((char**)col)[r];
+        if (s)
+            lua_pushstring(L,s);
+        else
+            lua_pushnil(L);
+        break;
+    }}
+}
+
+static void batch_store(lua_State *L, Batch *b, int i, int r, int idx) {
+    char kind = b->rets[i];
+    void *P = (char*)b->out[i] + r*kind_size(kind);
+    err_t err;
+    if (kind == 's') { // replacing a string which the column owns
+        obj_unref(*(char**)P);
+        *(char**)P = NULL;
+    }
+    err = llua_convert(L,kind,P,idx);
+    if (err) {
+        // (luaL_error does not return, so the error must go first)
+        char buff[256];
+        snprintf(buff,sizeof(buff),"result %d: %s",i+1,err);
+        obj_unref(err);
+        luaL_error(L,"%s",buff);
+    }
+}
+
+// the protected part: the function is at 2
+static int batch_rows(lua_State *L) {
+    Batch *b = (Batch*)lua_touserdata(L,1);
+    for (; b->row < b->n; b->row += b->chunk ? b->chunk : 1) {
+        lua_pushvalue(L,2);
+        if (! b->chunk) {
+            for (int i = 0; i < b->nargs; i++)
+                batch_push(L,b->args[i],b->in[i],b->row);
+            lua_call(L,b->nargs,b->nrets);
+            for (int i = 0; i < b->nrets; i++)
+                batch_store(L,b,i,b->row,i - b->nrets);
+        } else {
+            // each column of the chunk as a table
+            int m = b->n - b->row < b->chunk ? b->n - b->row : b->chunk;
+            for (int i = 0; i < b->nargs; i++) {
+                lua_createtable(L,m,0);
+                for (int r = 0; r < m; r++) {
+                    batch_push(L,b->args[i],b->in[i],b->row + r);
+                    lua_rawseti(L,-2,r+1);
+                }
+            }
+            lua_call(L,b->nargs,b->nrets);
+            for (int i = 0; i < b->nrets; i++) {
+                int idx = lua_gettop(L) - b->nrets + i + 1;
+                if (! lua_istable(L,idx))
+                    luaL_error(L,"result %d: not a table!",i+1);
+                for (int r = 0; r < m; r++) {
+                    lua_rawgeti(L,idx,r+1);
+                    batch_store(L,b,i,b->row + r,-1);
+                    lua_pop(L,1);
+                }
+            }
+        }
+        lua_pop(L,b->nrets);
+    }
+    return 0;
+}
+
+static void *batch_call(llua_t *fn, int chunk, const char *args, const char *rets, va_list ap) {
+    lua_State *L = fn->L;
+    char **errors = NULL;
+    Batch b;
+    b.args = args;
+    b.rets = rets;
+    b.nargs = strlen(args);
+    b.nrets = strlen(rets);
+    b.chunk = chunk;
+    if (b.nargs == 0)
+        return (void*)llua_error(fn,"batch needs at least one argument column");
+    b.in = malloc((b.nargs + b.nrets)*sizeof(void*));
+    b.out = b.in + b.nargs;
+    for (int i = 0; i < b.nargs + b.nrets; i++) {
+        char kind = i < b.nargs ? args[i] : rets[i - b.nargs];
+        void *col = va_arg(ap,void*);
+        if (! strchr("ifbs",kind)) {
+            free(b.in);
+            return (void*)llua_error(fn,"batch columns must be 'i', 'f', 'b' or 's'");
+        }
+        if (i == 0) {
+            b.n = array_len(col);
+        } else
+        if (array_len(col) < b.n) {
+            free(b.in);
+            return (void*)llua_error(fn,"batch column is too short");
+        }
+        b.in[i] = col;
+    }
+    b.row = 0;
+    while (b.row < b.n) {
+        lua_pushcfunction(L,batch_rows);
+        lua_pushlightuserdata(L,&b);
+        llua_push(fn);
+        if (lua_pcall(L,2,0,0) == LUA_OK)
+            break;
+        // the row (or chunk) failed; note it and carry on
+        if (! errors)
+            errors = array_new_ref(char*,b.n);
+        err_t err = l_error(L);
+        int end = b.row + (chunk ? chunk : 1);
+        if (end > b.n)
+            end = b.n;
+        errors[b.row] = (char*)err;
+        for (int r = b.row + 1; r < end; r++)
+            errors[r] = (char*)obj_ref(err);
+        b.row = end;
+    }
+    free(b.in);
+    return errors;
+}
+
+/// call a function over columns of values.
+// `args` and `rets` give the kinds of the argument and result columns,
+// which are llib arrays following `rets`: 'i' (`int*`), 'f' (`double*`),
+// 'b' (`bool*`) and 's' (`char**`, which should be a reference array;
+// results are new strings, which replace any strings already there).
+// The first column sets the number of rows.
+// Returns NULL if every row succeeded, otherwise a reference array holding
+// an error for each failed row (and NULL for the others), or an error
+// if the columns are not right; `value_is_error` tells these apart.
+// Either must be unref'd.
+// @within Calling
+// @usage char **errs = llua_batch(score,"fs","f",weights,names,scores);
+void *llua_batch(llua_t *fn, const char *args, const char *rets,...) {
+    va_list ap;
+    va_start(ap,rets);
+    void *res = batch_call(fn,0,args,rets,ap);
+    va_end(ap);
+    return res;
+}
+
+/// call a function over columns of values, `chunk` rows at a time.
+// As for `llua_batch`, but the function receives each column as a table of
+// up to `chunk` values, and returns a table for each result column. If a
+// call fails, every row of its chunk gets the error.
+// @within Calling
+void *llua_batch_chunks(llua_t *fn, int chunk, const char *args, const char *rets,...) {
+    va_list ap;
+    va_start(ap,rets);
+    void *res = batch_call(fn,chunk > 0 ? chunk : 1,args,rets,ap);
+    va_end(ap);
+    return res;
+}
+
+///// Table iterators
+// An iterator walks the array part of a table with `rawgeti`, and then
+// the rest with `lua_next`, converting keys and values into C arrays a
+// batch at a time. The last key is kept in one registry slot, so that the
+// iteration can be resumed by later calls, whatever happened to the stack.
+// If the table is changed between calls, that key may have gone from it,
+// and then `lua_next` would raise an error; so it's called in protected
+// mode when the key can't be found.
+
+struct LLuaIter_ {
+    llua_t *t;
+    int key_ref;    // the last key of the hash part
+    int alen, i;    // array part, and the next index in it
+    bool in_hash, started, done;
+    char kkind, vkind;
+    err_t err;
+};
+
+static void iter_dispose(llua_iter_t *it) {
+    luaL_unref(it->t->L,LUA_REGISTRYINDEX,it->key_ref);
+    obj_unref(it->t);
+    obj_unref(it->err);
+}
+
+/// an iterator over a table, with type specifiers for keys and values.
+// `kinds` is two specifiers, like "sf" for string keys and number values;
+// they may be 'i', 'f', 'b', 's', 'o', 'L' or 'V'.
+// @within GettingAndSetting
+// @usage llua_iter_t *it = llua_iter_new(T,"si");
+llua_iter_t *llua_iter_new(llua_t *o, const char *kinds) {
+    lua_State *L = o->L;
+    if (strlen(kinds) != 2 || ! kind_size(kinds[0]) || ! kind_size(kinds[1]))
+        return (llua_iter_t*)llua_error(o,"iterator needs a key and a value type specifier");
+    llua_push(o);
+    if (! lua_istable(L,-1)) {
+        lua_pop(L,1);
+        return (llua_iter_t*)llua_error(o,"not a table!");
+    }
+    llua_iter_t *it = obj_new(llua_iter_t,iter_dispose);
+    it->alen = lua_rawlen(L,-1);
+    lua_pop(L,1);
+    it->t = llua_hold(o);
+    lua_pushboolean(L,0); // a placeholder; the slot must never hold nil
+    it->key_ref = luaL_ref(L,LUA_REGISTRYINDEX);
+    it->i = 1;
+    it->in_hash = it->started = it->done = false;
+    it->kkind = kinds[0];
+    it->vkind = kinds[1];
+    it->err = NULL;
+    return it;
+}
+
+// was this key already visited in the array part?
+static bool is_array_key(lua_State *L, int idx, int alen) {
+    if (lua_type(L,idx) != LUA_TNUMBER)
+        return false;
+    lua_Number k = lua_tonumber(L,idx);
+    return k >= 1 && k <= alen && k == (int)k;
+}
+
+static int protected_next(lua_State *L) {
+    lua_settop(L,2);
+    return lua_next(L,1) ? 2 : 0;
+}
+
+// like lua_next, but returns -1 with an error if the key is no longer valid
+static int iter_lua_next(lua_State *L, int tidx, err_t *err) {
+    if (! lua_isnil(L,-1)) {
+        lua_pushvalue(L,-1);
+        lua_rawget(L,tidx);
+        bool present = ! lua_isnil(L,-1);
+        lua_pop(L,1);
+        if (present)
+            return lua_next(L,tidx);
+    } else {
+        return lua_next(L,tidx);
+    }
+    // (a key set to nil while iterating is still fine, unless the table was rehashed)
+    int top = lua_gettop(L) - 1;
+    lua_pushcfunction(L,protected_next);
+    lua_pushvalue(L,tidx);
+    lua_pushvalue(L,top+1);
+    if (lua_pcall(L,2,LUA_MULTRET,0) != LUA_OK) {
+        lua_settop(L,top);
+        *err = value_error("table changed during iteration");
+        return -1;
+    }
+    lua_remove(L,top+1);
+    return lua_gettop(L) > top;
+}
+
+/// get up to `n` more entries of the table.
+// `keys` and `vals` are arrays for the converted entries (either may be
+// NULL). Returns the number of entries, 0 at the end, or -1 if an entry
+// couldn't be converted (see `llua_iter_error`); the iterator stays at
+// that entry, after returning any good entries before it. It is also -1 if
+// the table was changed so that the iteration can't go on.
+// @within GettingAndSetting
+int llua_iter_next(llua_iter_t *it, int n, void *keys, void *vals) {
+    lua_State *L = llua_push(it->t);
+    int tidx = lua_gettop(L), count = 0;
+    int ksize = kind_size(it->kkind), vsize = kind_size(it->vkind);
+    err_t err = NULL;
+    while (count < n && ! it->done) {
+        // push the next key and value
+        if (! it->in_hash) {
+            if (it->i > it->alen) {
+                it->in_hash = true;
+                continue;
+            }
+            lua_rawgeti(L,tidx,it->i);
+            if (lua_isnil(L,-1)) { // a hole
+                lua_pop(L,1);
+                ++it->i;
+                continue;
+            }
+            lua_pushinteger(L,it->i);
+            lua_insert(L,-2);
+        } else {
+            if (it->started)
+                lua_rawgeti(L,LUA_REGISTRYINDEX,it->key_ref);
+            else
+                lua_pushnil(L);
+            int more = iter_lua_next(L,tidx,&err);
+            if (more < 0)
+                break;
+            if (! more) {
+                it->done = true;
+                break;
+            }
+            if (is_array_key(L,-2,it->alen)) {
+                lua_pop(L,1);
+                lua_rawseti(L,LUA_REGISTRYINDEX,it->key_ref);
+                it->started = true;
+                continue;
+            }
+        }
+        if (vals)
+            err = llua_convert(L,it->vkind,(char*)vals + count*vsize,-1);
+        if (! err && keys) {
+            // (a copy, since lua_tolstring would change a key under lua_next)
+            lua_pushvalue(L,-2);
+            err = llua_convert(L,it->kkind,(char*)keys + count*ksize,-1);
+            lua_pop(L,1);
+            if (err && vals && strchr("soL",it->vkind))
+                obj_unref(*(void**)((char*)vals + count*vsize));
+        }
+        if (err) {
+            lua_pop(L,2);
+            break;
+        }
+        // move on
+        if (it->in_hash) {
+            lua_pop(L,1);
+            lua_rawseti(L,LUA_REGISTRYINDEX,it->key_ref);
+            it->started = true;
+        } else {
+            lua_pop(L,2);
+            ++it->i;
+        }
+        ++count;
+    }
+    lua_pop(L,1);
+    obj_unref(it->err);
+    it->err = NULL;
+    if (err) { // a copy which belongs to the iterator
+        obj_pool_suspend();
+        it->err = value_error(err);
+        obj_pool_resume();
+        obj_unref(err);
+    }
+    if (err && count == 0)
+        return -1;
+    return count;
+}
+
+/// why the last `llua_iter_next` returned -1.
+// @within GettingAndSetting
+err_t llua_iter_error(llua_iter_t *it) {
+    return it->err;
+}
+
+///// Statistics
+// The counters cost a plain add each, in every thread, so they are always
+// on. The registry high-water mark and pool depth are looked up for the snapshot.
+
+/// take a snapshot of the counters, added up over all threads.
+// `L` is only needed for the registry high-water mark, and may be NULL.
+// Live references are `refs_created - refs_freed`.
+// Pool depth is for the calling thread.
+// @within Properties
+void llua_stats(lua_State *L, llua_stats_t *st) {
+    memset(st,0,sizeof(llua_stats_t));
+    for (StatsBlock *b = (StatsBlock*)OBJ_ATOMIC_LOAD(s_all_stats); b; b = (StatsBlock*)b->hdr.next) {
+        st->refs_created += OBJ_ATOMIC_LOAD(b->st.refs_created);
+        st->refs_freed += OBJ_ATOMIC_LOAD(b->st.refs_freed);
+        st->calls += OBJ_ATOMIC_LOAD(b->st.calls);
+        st->call_errors += OBJ_ATOMIC_LOAD(b->st.call_errors);
+        st->copies += OBJ_ATOMIC_LOAD(b->st.copies);
+        st->copied_bytes += OBJ_ATOMIC_LOAD(b->st.copied_bytes);
+    }
+    st->objects_created = obj_created();
+    st->objects_live = obj_kount();
+    st->registry_high = L ? (int)lua_rawlen(L,LUA_REGISTRYINDEX) : 0;
+    st->pool_depth = obj_pool_depth();
+}
+
+static void prom_metric(FILE *out, const char *name, const char *type, const char *help, int64 val) {
+    fprintf(out,"# HELP %s %s\n# TYPE %s %s\n%s %lld\n",name,help,name,type,name,(long long)val);
+}
+
+/// write the counters in the Prometheus text format.
+// Includes the objects created and alive, and the bytes allocated (not
+// counting frees), for each llib type.
+// @within Properties
+void llua_stats_dump(lua_State *L, FILE *out) {
+    llua_stats_t st;
+    llua_stats(L,&st);
+    prom_metric(out,"llua_refs_created_total","counter","Lua references created",st.refs_created);
+    prom_metric(out,"llua_refs_freed_total","counter","Lua references freed",st.refs_freed);
+    prom_metric(out,"llua_refs_live","gauge","Lua references alive",st.refs_created - st.refs_freed);
+    prom_metric(out,"llua_registry_high_water","gauge","registry slots ever used (freed slots are not given back)",st.registry_high);
+    prom_metric(out,"llua_calls_total","counter","calls through llua_callf and llua_sig_call",st.calls);
+    prom_metric(out,"llua_call_errors_total","counter","calls which raised an error",st.call_errors);
+    prom_metric(out,"llua_copies_total","counter","strings and arrays copied out of Lua",st.copies);
+    prom_metric(out,"llua_copied_bytes_total","counter","bytes copied out of Lua",st.copied_bytes);
+    prom_metric(out,"llib_objects_created_total","counter","llib objects created",st.objects_created);
+    prom_metric(out,"llib_objects_live","gauge","llib objects alive",st.objects_live);
+    prom_metric(out,"llib_pool_depth","gauge","object pools active in this thread",st.pool_depth);
+    int ntypes = obj_type_count();
+    ObjTypeCounts *tcs = malloc(ntypes*sizeof(ObjTypeCounts));
+    for (int i = 0; i < ntypes; i++)
+        obj_type_counts(i,&tcs[i]);
+    for (int m = 0; m < 3; m++) {
+        static const char *metrics[] = {
+            "llib_type_objects_total","counter","llib objects created, by type",
+            "llib_type_objects_live","gauge","llib objects alive, by type",
+            "llib_type_bytes_total","counter","bytes ever allocated for llib objects, by type (frees are not subtracted)"
+        };
+        const char *name = metrics[3*m];
+        fprintf(out,"# HELP %s %s\n# TYPE %s %s\n",name,metrics[3*m+2],name,metrics[3*m+1]);
+        for (int i = 0; i < ntypes; i++) {
+            ObjType *t = obj_type_at(i);
+            ObjTypeCounts *tc = &tcs[i];
+            if (t->name && tc->created) {
+                int64 val = m == 0 ? tc->created : m == 1 ? tc->created - tc->freed : tc->bytes;
+                fprintf(out,"%s{type=\"%s\"} %lld\n",name,t->name,(long long)val);
+            }
+        }
+    }
+    free(tcs);
+}
+
+///// Paths
+// A path like "server.tls.ciphers[2]" is split once into its segments, which
+// are kept as Lua values (strings or integers) in the registry, so that
+// resolving it is just a registry fetch and a gettable per segment.
+
+struct LLuaPath_ {
+    lua_State *L;
+    char *path;
+    int *ends;      // where each segment ends in `path`, for errors
+    int *keys;
+    bool memo;
+    llua_t *value;  // memoized value, as a reference and as an object
+    void *obj;
+};
+
+static void llua_path_dispose(llua_path_t *p) {
+    for (int k = 0; k < array_len(p->keys); k++)
+        luaL_unref(p->L,LUA_REGISTRYINDEX,p->keys[k]);
+    obj_unref(p->keys);
+    obj_unref(p->path);
+    obj_unref(p->ends);
+    obj_unref(p->value);
+    obj_unref(p->obj);
+}
+
+/// compile a path for nested lookups.
+// Segments are separated by dots, and may also be integer indices like `[2]`
+// or quoted keys like `["a.b"]`. If `memo` is true, the path is resolved only once
+// and the value is kept; use this for things that don't change, like `string.find`.
+// @within GettingAndSetting
+// @usage llua_path_t *find = llua_path_new(L,"string.find",true);
+llua_path_t *llua_path_new(lua_State *L, const char *path, bool memo) {
+    int n = 0, cap = 4;
+    int *ends = array_new(int,cap);
+    const char *p = path;
+    int top = lua_gettop(L);
+    while (*p) {
+        if (*p == '[') {
+            ++p;
+            if (*p == '"' || *p == '\'') {
+                const char *q = strchr(p+1,*p);
+                if (! q || q[1] != ']')
+                    break;
+                lua_pushlstring(L,p+1,q - p - 1);
+                p = q + 2;
+            } else {
+                char *end;
+                long idx = strtol(p,&end,10);
+                if (end == p || *end != ']')
+                    break;
+                lua_pushinteger(L,idx);
+                p = end + 1;
+            }
+        } else {
+            const char *start = p;
+            while (*p && *p != '.' && *p != '[')
+                ++p;
+            if (p == start)
+                break;
+            lua_pushlstring(L,start,p - start);
+        }
+        if (++n == cap)
+            ends = array_resize(ends,cap *= 2);
+        ends[n-1] = p - path;
+        if (*p == '.' && p[1] && p[1] != '.' && p[1] != '[')
+            ++p;
+        else if (*p && *p != '[')
+            break;
+    }
+    if (*p || n == 0) {
+        lua_settop(L,top);
+        obj_unref(ends);
+        return (llua_path_t*)value_error("bad path");
+    }
+    llua_path_t *res = obj_new(llua_path_t,llua_path_dispose);
+    res->L = L;
+    obj_pool_suspend(); // the parts belong to the path
+    res->keys = array_new(int,n);
+    for (int k = n-1; k >= 0; k--) // the segments are on the stack
+        res->keys[k] = luaL_ref(L,LUA_REGISTRYINDEX);
+    res->path = str_new(path);
+    res->ends = array_resize(ends,n);
+    obj_pool_resume();
+    res->memo = memo;
+    res->value = NULL;
+    res->obj = NULL;
+    return res;
+}
+
+// push the value at the end of the path, or return an error naming the
+// first part of the path which could not be indexed
+static err_t path_resolve(llua_path_t *p, llua_t *root) {
+    lua_State *L = p->L;
+    int n = array_len(p->keys), base = lua_gettop(L);
+    if (root) {
+        llua_push(root);
+    } else {
+#if LUA_VERSION_NUM == 501
+        lua_pushvalue(L,LUA_GLOBALSINDEX);
+#else
+        lua_rawgeti(L,LUA_REGISTRYINDEX,LUA_RIDX_GLOBALS);
+#endif
+    }
+    for (int k = 0; k < n; k++) {
+        if (! can_index(L,-1)) {
+            char buff[256];
+            if (k == 0)
+                snprintf(buff,sizeof(buff),"path '%s': root is %s",p->path,luaL_typename(L,-1));
+            else
+                snprintf(buff,sizeof(buff),"path '%s': '%.*s' is %s",
+                    p->path,p->ends[k-1],p->path,luaL_typename(L,-1));
+            lua_settop(L,base);
+            return value_error(buff);
+        }
+        lua_rawgeti(L,LUA_REGISTRYINDEX,p->keys[k]);
+        lua_gettable(L,-2);
+    }
+    // the parents are still on the stack
+    lua_replace(L,base+1);
+    lua_settop(L,base+1);
+    return NULL;
+}
+
+// keep the value on the stack; like the other parts, it belongs to the path
+static void path_memo(llua_path_t *p) {
+    obj_pool_suspend();
+    p->value = llua_new(p->L,-1);
+    obj_pool_resume();
+}
+
+/// look up a path, returning an object.
+// `root` may be NULL, meaning the globals. As with `llua_gets`, the value
+// is converted with `llua_to_obj`, and a nil value is NULL.
+// @within GettingAndSetting
+void *llua_path_get(llua_path_t *p, llua_t *root) {
+    if (p->obj)
+        return obj_ref(p->obj);
+    if (p->value) {
+        llua_push(p->value);
+    } else {
+        err_t err = path_resolve(p,root);
+        if (err)
+            return (void*)llua_error(root,err);
+        if (p->memo && ! lua_isnil(p->L,-1))
+            path_memo(p);
+    }
+    if (p->value) { // memoized
+        obj_pool_suspend();
+        p->obj = llua_to_obj_pop(p->L,-1);
+        obj_pool_resume();
+        return obj_ref(p->obj);
+    }
+    return llua_to_obj_pop(p->L,-1);
+}
+
+/// look up a path, converting the value with a type specifier.
+// @within GettingAndSetting
+err_t llua_path_get_as(llua_path_t *p, llua_t *root, char kind, void *P) {
+    err_t err = NULL;
+    if (p->value) {
+        llua_push(p->value);
+    } else {
+        err = path_resolve(p,root);
+        if (err)
+            return llua_error(root,err);
+        if (p->memo && ! lua_isnil(p->L,-1))
+            path_memo(p);
+    }
+    err = llua_convert(p->L,kind,P,-1);
+    lua_pop(p->L,1);
+    return llua_error(root,err);
+}
+
+/// push an llib object.
+// equivalent to `llua_push` if it's a llua ref, otherwise
+// uses llib type. If there's no type it assumes a plain
+// string literal.
+void llua_push_object(lua_State *L, void *value) {
+    if (llua_is_lua_object((llua_t*)value)) {
+        llua_push((llua_t*)value);
+    }  else
+    if (value_is_float(value)) {
+        lua_pushnumber(L,value_as_float(value));
+    } else
+    if (value_is_string(value)) {
+        lua_pushstring(L,(const char*)value);
+    } else
+    if (value_is_int(value)) {
+        lua_pushnumber(L,value_as_int(value));
+    } else
+    if (value_is_bool(value)) {
+        lua_pushboolean(L,value_as_bool(value));
+    }  else { // _probably_ a string. You have been warned...
+        lua_pushstring(L,(const char*)value);
+    }
+}
+
+/// set value using integer key.
+// uses `llua_push_object`
+// @within GettingAndSetting
+void llua_seti(llua_t *o, int key, void *value) {
+    lua_State *L = llua_push(o);
+    lua_pushinteger(L,key);
+    llua_push_object(L,value);
+    lua_settable(L,-3);
+}
+/// set value using integer key.
+// uses `llua_push_object`
+// @within GettingAndSetting
+void llua_sets(llua_t *o, const char *key, void *value) {
+    lua_State *L = llua_push(o);
+    llua_push_object(L,value);
+    lua_setfield(o->L,-2,key);
+}
+
+// there's some code duplication here with llua_callf, but I'm not
+// 100% sure how far to push <stdarg.h>!
+
+/// set multiple keys and values on the reference.
+// uses type specifiers like `llua_callf`
+// @within GettingAndSetting
+err_t llua_sets_v(llua_t *o, const char *key,...) {
+    lua_State *L = llua_push(o);
+    const char *fmt;
+    err_t err = NULL;
+    va_list ap;
+    va_start(ap,key);
+    while (key) { // key followed by type specifier and pointer-to-data
+        fmt = va_arg(ap,const char*);
+        switch(*fmt) {
+        case 'i':
+            lua_pushinteger(L, va_arg(ap,int));
+            break;
+        case 'b':
+            lua_pushboolean(L, va_arg(ap,int));
+            break;
+        case 'f':
+            lua_pushnumber(L, va_arg(ap,double));
+            break;
+        default:
+            err = push_value(L,*fmt,va_arg(ap,void*));
+            break;
         }
         lua_setfield(o->L,-2,key);
         key = va_arg(ap,const char*);
@@ -709,13 +3023,431 @@ err_t llua_sets_v(llua_t *o, const char *key,...) {
     return llua_error(o,err);
 }
 
+///// Struct schemas
+// A schema describes how the fields of a C struct map onto table keys.
+// The keys (and the parts of dotted keys) are interned once in a table of
+// strings, so filling or writing a struct does no string handling at all.
+
+typedef struct {
+    char *key;
+    int offset;
+    char kind;
+    bool optional;
+    int first, nseg;    // the key's parts in the key table
+} SchemaField;
+
+struct LLuaSchema_ {
+    lua_State *L;
+    int keys;
+    int n;
+    SchemaField *fields;
+};
+
+#define SCHEMA_KINDS "ibfsVBoLIFS"
+
+static void llua_schema_dispose(llua_schema_t *s) {
+    luaL_unref(s->L,LUA_REGISTRYINDEX,s->keys);
+    for (int i = 0; i < s->n; i++)
+        obj_unref(s->fields[i].key);
+    obj_unref(s->fields);
+}
+
+/// make a schema for filling and writing back a struct.
+// `fields` is terminated by a `NULL` key; each field has a key (which may be
+// dotted like "author.name"), a type specifier as for `llua_convert`
+// and the field offset, conveniently given with `LLUA_FIELD`.
+// A type prefixed with '?' is optional: a missing value leaves the field alone.
+// Returns an error if a type specifier is not valid.
+// @within GettingAndSetting
+// @usage static llua_field_t config_fields[] = {
+//     LLUA_FIELD(Config,alpha,"i"),
+//     {"author.name","s",offsetof(Config,author_name)},
+//     {NULL}
+// };
+llua_schema_t *llua_schema_new(lua_State *L, const llua_field_t *fields) {
+    int n = 0, nkeys = 0;
+    for (const llua_field_t *f = fields; f->key; f++, n++) {
+        const char *type = f->type + (*f->type == '?');
+        if (! *type || type[1] || ! strchr(SCHEMA_KINDS,*type))
+            return (llua_schema_t*)value_error("unknown field type");
+    }
+    llua_schema_t *s = obj_new(llua_schema_t,llua_schema_dispose);
+    s->L = L;
+    obj_pool_suspend(); // the fields belong to the schema
+    s->n = n;
+    s->fields = array_new(SchemaField,n);
+    lua_newtable(L);
+    for (int i = 0; i < n; i++) {
+        const llua_field_t *f = &fields[i];
+        SchemaField *sf = &s->fields[i];
+        sf->key = str_new(f->key);
+        sf->offset = f->offset;
+        sf->optional = *f->type == '?';
+        sf->kind = f->type[sf->optional];
+        sf->first = nkeys + 1;
+        sf->nseg = 0;
+        for (const char *k = f->key, *dot; k; k = dot ? dot+1 : NULL) {
+            dot = strchr(k,'.');
+            lua_pushlstring(L,k,dot ? dot - k : strlen(k));
+            lua_rawseti(L,-2,++nkeys);
+            ++sf->nseg;
+        }
+    }
+    obj_pool_resume();
+    s->keys = luaL_ref(L,LUA_REGISTRYINDEX);
+    return s;
+}
+
+// the value at the top is a table, or has the metamethod `event`, so that
+// the unprotected gets and sets of a schema can't raise an error.
+// Otherwise the keys and the value are popped and an error is returned.
+static err_t schema_target(lua_State *L, const char *event, const char *verb) {
+    char buff[64];
+    if (lua_istable(L,-1))
+        return NULL;
+    if (luaL_getmetafield(L,-1,event)) {
+        lua_pop(L,1);
+        return NULL;
+    }
+    snprintf(buff,sizeof(buff),"cannot %s %s",verb,luaL_typename(L,-1));
+    lua_pop(L,2);
+    return value_error(buff);
+}
+
+/// fill a struct from a table using a schema.
+// Fields are converted as with `llua_gets_v`, and an error names the field.
+// It is an error if `o` is not a table, or something with `__index`.
+// @within GettingAndSetting
+err_t llua_schema_fill(llua_schema_t *s, llua_t *o, void *dest) {
+    lua_State *L = o->L;
+    lua_rawgeti(L,LUA_REGISTRYINDEX,s->keys);
+    int keys = lua_gettop(L);
+    llua_push(o);
+    err_t err = schema_target(L,"__index","fill from");
+    if (err)
+        return llua_error(o,err);
+    for (int i = 0; i < s->n && ! err; i++) {
+        SchemaField *sf = &s->fields[i];
+        lua_rawgeti(L,keys,sf->first);
+        lua_gettable(L,keys+1);
+        for (int k = 1; k < sf->nseg; k++) {
+            if (! can_index(L,-1)) { // missing parent is a missing value
+                lua_pop(L,1);
+                lua_pushnil(L);
+                break;
+            }
+            lua_rawgeti(L,keys,sf->first + k);
+            lua_gettable(L,-2);
+            lua_remove(L,-2);
+        }
+        if (! (sf->optional && lua_isnil(L,-1)))
+            err = llua_convert(L,sf->kind,(char*)dest + sf->offset,-1);
+        lua_pop(L,1);
+        if (err) {
+            char buff[256];
+            snprintf(buff,sizeof(buff),"field '%s': %s",sf->key,err);
+            unref(err);
+            err = value_error(buff);
+        }
+    }
+    lua_pop(L,2);
+    return llua_error(o,err);
+}
+
+static void push_array(lua_State *L, char kind, void *arr) {
+    int n = array_len(arr);
+    lua_createtable(L,n,0);
+    for (int i = 0; i < n; i++) {
+        if (kind == 'I')
+            lua_pushinteger(L,((int*)arr)[i]);
+        else if (kind == 'F')
+            lua_pushnumber(L,((double*)arr)[i]);
+        else
+            lua_pushstring(L,((char**)arr)[i]);
+        lua_rawseti(L,-2,i+1);
+    }
+}
+
+static void push_field(lua_State *L, char kind, void *P) {
+    switch(kind) {
+    case 'i':
+        lua_pushinteger(L,*(int*)P);
+        break;
+    case 'b':
+        lua_pushboolean(L,*(bool*)P);
+        break;
+    case 'f':
+        lua_pushnumber(L,*(double*)P);
+        break;
+    case 'V':
+        lua_pushlstring(L,((llua_view_t*)P)->str,((llua_view_t*)P)->len);
+        break;
+    case 'B': {
+        llua_buf_t *b = (llua_buf_t*)P;
+        lua_pushlstring(L,b->buf,b->len < b->size ? b->len : strlen(b->buf));
+        break;
+    }
+    default: { // pointers, where NULL means nil
+        void *ptr = *(void**)P;
+        if (! ptr)
+            lua_pushnil(L);
+        else if (kind == 's')
+            lua_pushstring(L,(const char*)ptr);
+        else if (kind == 'I' || kind == 'F' || kind == 'S')
+            push_array(L,kind,ptr);
+        else
+            llua_push_object(L,ptr);
+    }
+    }
+}
+
+/// write a struct into a table using a schema.
+// This is the reverse of `llua_schema_fill`; tables for dotted keys are
+// created if needed, and NULL pointers become nil.
+// It is an error if `o` is not a table, or something with `__newindex`.
+// @within GettingAndSetting
+err_t llua_schema_write(llua_schema_t *s, llua_t *o, const void *src) {
+    lua_State *L = o->L;
+    lua_rawgeti(L,LUA_REGISTRYINDEX,s->keys);
+    int keys = lua_gettop(L);
+    llua_push(o);
+    err_t err = schema_target(L,"__newindex","write to");
+    if (err)
+        return llua_error(o,err);
+    for (int i = 0; i < s->n; i++) {
+        SchemaField *sf = &s->fields[i];
+        int k = 0;
+        lua_pushvalue(L,keys+1);
+        for (; k < sf->nseg - 1; k++) {
+            lua_rawgeti(L,keys,sf->first + k);
+            lua_gettable(L,-2);
+            if (! can_index(L,-1)) {
+                lua_pop(L,1);
+                lua_newtable(L);
+                lua_rawgeti(L,keys,sf->first + k);
+                lua_pushvalue(L,-2);
+                lua_settable(L,-4);
+            }
+            lua_remove(L,-2);
+        }
+        lua_rawgeti(L,keys,sf->first + k);
+        push_field(L,sf->kind,(char*)src + sf->offset);
+        lua_settable(L,-3);
+        lua_pop(L,1);
+    }
+    lua_pop(L,2);
+    return NULL;
+}
+
+///// Chunk cache
+// Compiled chunks are kept as references in a small LRU list, owned by
+// a userdata in the registry so that it goes away with the state.
+// Lookup is a linear scan of hashes, since we expect tens of entries, not thousands.
+
+typedef struct {
+    uint32 hash;
+    char *key;      // expression text or file path
+    bool file;
+    time_t mtime;   // files are also keyed by modification time and size
+    long size;
+    llua_t *chunk;
+    unsigned long used;
+} ChunkEntry;
+
+typedef struct {
+    lua_State *L;   // chunks are loaded and run in the state that owns the cache
+    ChunkEntry *entries;
+    int capacity, n;
+    unsigned long tick;
+    int hits, misses;
+    llua_t *env_maker; // Lua 5.2+: makes fresh _ENV upvalues
+} ChunkCache;
+
+static char chunk_cache_key;
+
+static ChunkCache *chunk_cache(lua_State *L) {
+    lua_pushlightuserdata(L,&chunk_cache_key);
+    lua_rawget(L,LUA_REGISTRYINDEX);
+    ChunkCache *cc = (ChunkCache*)lua_touserdata(L,-1);
+    lua_pop(L,1);
+    return cc;
+}
+
+static uint32 chunk_hash(const char *s) {
+    uint32 h = 2166136261u;
+    for (; *s; s++)
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    return h;
+}
+
+static void cache_drop(ChunkCache *cc, int i) {
+    ChunkEntry *e = &cc->entries[i];
+    obj_unref(e->chunk);
+    free(e->key);
+    cc->entries[i] = cc->entries[--cc->n];
+}
+
+static void cache_drop_lru(ChunkCache *cc) {
+    int oldest = 0;
+    for (int i = 1; i < cc->n; i++)
+        if (cc->entries[i].used < cc->entries[oldest].used)
+            oldest = i;
+    cache_drop(cc,oldest);
+}
+
+static void cache_clear(ChunkCache *cc) {
+    while (cc->n > 0)
+        cache_drop(cc,cc->n-1);
+    free(cc->entries);
+    cc->entries = NULL;
+    cc->capacity = 0;
+    if (cc->env_maker) {
+        obj_unref(cc->env_maker);
+        cc->env_maker = NULL;
+    }
+}
+
+static int chunk_cache_gc(lua_State *L) {
+    cache_clear((ChunkCache*)lua_touserdata(L,1));
+    return 0;
+}
+
+// a new reference to the cached chunk, or NULL.
+// A file entry whose file has changed is dropped.
+static llua_t *cache_lookup(ChunkCache *cc, uint32 hash, const char *key, struct stat *st) {
+    for (int i = 0; i < cc->n; i++) {
+        ChunkEntry *e = &cc->entries[i];
+        if (e->hash == hash && e->file == (st != NULL) && strcmp(e->key,key) == 0) {
+            if (st && (e->mtime != st->st_mtime || e->size != (long)st->st_size)) {
+                cache_drop(cc,i);
+                break;
+            }
+            e->used = ++cc->tick;
+            ++cc->hits;
+            return obj_ref(e->chunk);
+        }
+    }
+    ++cc->misses;
+    return NULL;
+}
+
+static void cache_insert(ChunkCache *cc, uint32 hash, const char *key, struct stat *st, llua_t *chunk) {
+    if (cc->n == cc->capacity)
+        cache_drop_lru(cc);
+    ChunkEntry *e = &cc->entries[cc->n++];
+    e->hash = hash;
+    e->key = malloc(strlen(key)+1);
+    strcpy(e->key,key);
+    e->file = st != NULL;
+    e->mtime = st ? st->st_mtime : 0;
+    e->size = st ? (long)st->st_size : 0;
+    // a reference of our own, since `chunk` may be drained with a pool or arena
+    llua_push(chunk);
+    obj_pool_suspend();
+    e->chunk = llua_new(cc->L,-1);
+    obj_pool_resume();
+    lua_pop(cc->L,1);
+    e->used = ++cc->tick;
+}
+
+/// cache compiled chunks for `llua_eval` and `llua_evalfile`.
+// Up to `capacity` chunks are kept as references, and the least recently
+// used one is dropped when the cache is full. Expressions are keyed by their
+// text and files by path, modification time and size. The cache belongs to
+// `L`, and cached chunks are loaded and run there. A capacity of zero drops the cache.
+// @within LoadingAndEvaluating
+void llua_cache_chunks(lua_State *L, int capacity) {
+    ChunkCache *cc = chunk_cache(L);
+    if (capacity <= 0) {
+        if (cc) {
+            cache_clear(cc);
+            lua_pushlightuserdata(L,&chunk_cache_key);
+            lua_pushnil(L);
+            lua_rawset(L,LUA_REGISTRYINDEX);
+        }
+        return;
+    }
+    if (! cc) {
+        lua_pushlightuserdata(L,&chunk_cache_key);
+        cc = (ChunkCache*)lua_newuserdata(L,sizeof(ChunkCache));
+        memset(cc,0,sizeof(ChunkCache));
+        cc->L = L;
+        if (luaL_newmetatable(L,"llua.chunkcache")) {
+            lua_pushcfunction(L,chunk_cache_gc);
+            lua_setfield(L,-2,"__gc");
+        }
+        lua_setmetatable(L,-2);
+        lua_rawset(L,LUA_REGISTRYINDEX);
+    }
+    while (cc->n > capacity)
+        cache_drop_lru(cc);
+    cc->entries = realloc(cc->entries,capacity*sizeof(ChunkEntry));
+    cc->capacity = capacity;
+}
+
+/// statistics for the chunk cache.
+// Returns the number of cached chunks; `hits` and `misses` may be NULL.
+// @within LoadingAndEvaluating
+int llua_cache_stats(lua_State *L, int *hits, int *misses) {
+    ChunkCache *cc = chunk_cache(L);
+    if (hits)
+        *hits = cc ? cc->hits : 0;
+    if (misses)
+        *misses = cc ? cc->misses : 0;
+    return cc ? cc->n : 0;
+}
+
+// a cached chunk is run again and again, so its environment is always set,
+// to the globals if `env` is NULL. With 5.2+ each call gets a fresh _ENV upvalue,
+// so that functions left behind by earlier calls keep their environment.
+static void chunk_setenv(ChunkCache *cc, llua_t *chunk, llua_t *env) {
+    lua_State *L = llua_push(chunk);
+#if LUA_VERSION_NUM == 501
+    if (env)
+        llua_push(env);
+    else
+        lua_pushvalue(L,LUA_GLOBALSINDEX);
+    lua_setfenv(L,-2);
+    lua_pop(L,1);
+#else
+    if (! cc->env_maker) {
+        const char *maker = "local env = ...; return function() return env end";
+        luaL_loadbuffer(L,maker,strlen(maker),"=env");
+        obj_pool_suspend();
+        cc->env_maker = llua_to_obj_pop(L,-1);
+        obj_pool_resume();
+    }
+    llua_push(cc->env_maker);
+    if (env)
+        llua_push(env);
+    else
+        lua_rawgeti(L,LUA_REGISTRYINDEX,LUA_RIDX_GLOBALS);
+    lua_call(L,1,1);
+    // _ENV is first upvalue of main chunks
+    lua_upvaluejoin(L,-2,1,-1,1);
+    lua_pop(L,2);
+#endif
+}
+
 /// load and evaluate an expression.
 // `fret` is a type specifier for the result, like `llua_callf`.
+// The compiled chunk is cached if `llua_cache_chunks` has been called.
 // @within LoadingAndEvaluating
 void *llua_eval(lua_State *L, const char *expr, const char *fret) {
-    llua_t *chunk = llua_load(L,expr,"tmp");
-    if (value_is_error(chunk)) // compile failed...
-        return chunk;
+    ChunkCache *cc = chunk_cache(L);
+    uint32 hash = 0;
+    llua_t *chunk = NULL;
+    if (cc) {
+        hash = chunk_hash(expr);
+        chunk = cache_lookup(cc,hash,expr,NULL);
+    }
+    if (! chunk) {
+        chunk = llua_load(cc ? cc->L : L,expr,"tmp");
+        if (value_is_error(chunk)) // compile failed...
+            return chunk;
+        if (cc)
+            cache_insert(cc,hash,expr,NULL,chunk);
+    }
     void *res = llua_callf(chunk,"",fret);
     obj_unref(chunk); // free the chunk reference...
     return res;
@@ -724,12 +3456,29 @@ void *llua_eval(lua_State *L, const char *expr, const char *fret) {
 /// load and evaluate a file in an environment
 // `env` may be NULL.
 // `fret` is a type specifier for the result, like `llua_callf`.
+// The compiled chunk is cached if `llua_cache_chunks` has been called.
 // @within LoadingAndEvaluating
 void *llua_evalfile(lua_State *L, const char *file, const char *fret, llua_t *env) {
-    llua_t *chunk = llua_loadfile(L,file);
-    if (value_is_error(chunk)) // compile failed...
-        return llua_error(env,(err_t)chunk);
-    if (env) {
+    ChunkCache *cc = chunk_cache(L);
+    struct stat st;
+    uint32 hash = 0;
+    llua_t *chunk = NULL;
+    if (cc && stat(file,&st) == 0) {
+        hash = chunk_hash(file);
+        chunk = cache_lookup(cc,hash,file,&st);
+    } else {
+        cc = NULL; // let llua_loadfile report a missing file
+    }
+    if (! chunk) {
+        chunk = llua_loadfile(cc ? cc->L : L,file);
+        if (value_is_error(chunk)) // compile failed...
+            return llua_error(env,(err_t)chunk);
+        if (cc)
+            cache_insert(cc,hash,file,&st,chunk);
+    }
+    if (cc) {
+        chunk_setenv(cc,chunk,env);
+    } else if (env) {
         llua_push(chunk);
         llua_push(env);
 #if LUA_VERSION_NUM == 501
@@ -744,5 +3493,3 @@ void *llua_evalfile(lua_State *L, const char *file, const char *fret, llua_t *en
     obj_unref(chunk);
     return (void*) llua_error(env,res);
 }
-
-
@@ -2,6 +2,7 @@
 #define LLUA_H
 #else
 #include <stdio.h>
+#include <stddef.h>
 #include <llib/obj.h>
 #include <llib/value.h>
 #include <lua.h>
@@ -15,8 +16,86 @@ typedef struct LLua_ {
     int ref;
     int type;
     bool error;
+    bool borrowed;  // `ref` is a stack slot (see llua_borrow)
 } llua_t;
 
+// a snapshot of the counters (see llua_stats)
+typedef struct LLuaStats_ {
+    int64 refs_created, refs_freed;
+    int64 calls, call_errors;       // through llua_callf and llua_sig_call
+    int64 copies, copied_bytes;     // strings and arrays copied out of Lua
+    int64 objects_created;
+    int objects_live;
+    int registry_high;  // registry slots ever used; freed slots are reused, not given back
+    int pool_depth;
+} llua_stats_t;
+
+// call latencies of a function in nanoseconds (see llua_profile)
+typedef struct LLuaProfile_ {
+    const char *label;  // chunk name and line
+    int64 count;
+    double mean;
+    int64 p50, p90, p99, p999, max;
+} llua_profile_t;
+
+// a call signature prepared with llua_sig_new
+typedef struct LLuaSig_ {
+    llua_t *fn;
+    char *args;
+    char *rets;
+    int nargs;
+    int nres;
+    bool method;
+    char ret_mode;          // how results are returned, decoded from rets
+    unsigned char *plan;    // decoded argument kinds, then result kinds
+} llua_sig_t;
+
+// a string borrowed from Lua with the 'V' specifier
+typedef struct LLuaView_ {
+    const char *str;
+    int len;
+} llua_view_t;
+
+// a caller's buffer for a string, filled by the 'B' specifier
+typedef struct LLuaBuf_ {
+    char *buf;
+    int size;
+    int len;
+} llua_buf_t;
+
+#define LLUA_BUF(arr) {arr,sizeof(arr),0}
+
+// a field of a struct schema (see llua_schema_new)
+typedef struct LLuaField_ {
+    const char *key;
+    const char *type;
+    int offset;
+} llua_field_t;
+
+#define LLUA_FIELD(T,field,type) {#field,type,offsetof(T,field)}
+
+typedef struct LLuaSchema_ llua_schema_t;
+
+// interned keys are references to Lua strings (see llua_key)
+typedef llua_t llua_key_t;
+
+typedef struct LLuaPath_ llua_path_t;
+
+// compact references into a handle table (see llua_handles_new)
+typedef struct LLuaHandles_ llua_handles_t;
+typedef unsigned long long llua_handle_t;
+
+// a scope for borrowed references (see llua_scope_begin)
+typedef struct LLuaScope_ llua_scope_t;
+
+// batched table iteration (see llua_iter_new)
+typedef struct LLuaIter_ llua_iter_t;
+
+// coroutine tasks (see llua_sched_new)
+typedef struct LLuaSched_ llua_sched_t;
+typedef unsigned long long llua_task_t;
+typedef void (*llua_wait_fn)(llua_sched_t *S, llua_task_t task, const char *reason, lua_State *co, int nargs);
+
 // useful names for common function returns
 #define L_VAL "r"
 #define L_REF "rL"
@@ -50,8 +129,33 @@ void llua_setmetatable(llua_t *o, llua_t *mt);
 const char *llua_typename(llua_t *o);
 llua_t *llua_newtable(lua_State *L);
 llua_t *llua_cfunction(lua_State *L, lua_CFunction f);
+llua_handles_t *llua_handles_new(lua_State *L);
+llua_handle_t llua_handle_new(llua_handles_t *H, int idx);
+bool llua_handle_push(llua_handles_t *H, llua_handle_t h);
+llua_t *llua_handle_get(llua_handles_t *H, llua_handle_t h);
+bool llua_handle_free(llua_handles_t *H, llua_handle_t h);
+int llua_handles_count(llua_handles_t *H);
+llua_scope_t *llua_scope_begin(lua_State *L);
+llua_t *llua_borrow(llua_scope_t *S, int idx);
+void llua_scope_end(llua_scope_t *S);
+llua_iter_t *llua_iter_new(llua_t *o, const char *kinds);
+int llua_iter_next(llua_iter_t *it, int n, void *keys, void *vals);
+err_t llua_iter_error(llua_iter_t *it);
+llua_sched_t *llua_sched_new(lua_State *L, int tick_ms, llua_wait_fn on_wait, void *data);
+void *llua_sched_data(llua_sched_t *S);
+int llua_sched_count(llua_sched_t *S);
+llua_task_t llua_sched_spawn(llua_sched_t *S, llua_t *fn, const char *fmt,...);
+bool llua_sched_resume(llua_sched_t *S, llua_task_t task, const char *fmt,...);
+int llua_sched_run(llua_sched_t *S, int64 now);
+void llua_stats(lua_State *L, llua_stats_t *st);
+void llua_stats_dump(lua_State *L, FILE *out);
+void llua_profile(bool on);
+void llua_profile_reset();
+bool llua_profile_get(llua_t *fn, llua_profile_t *e);
+int llua_profile_report(llua_profile_t *entries, int n);
 llua_t *llua_load(lua_State *L, const char *code, const char *name);
 llua_t *llua_loadfile(lua_State *L, const char *filename);
+void llua_bytecode_cache(const char *dir);
 lua_State *llua_push(llua_t *o);
 lua_State *_llua_push_nil(llua_t *o);
 int llua_len(llua_t *o);
@@ -59,8 +163,18 @@ err_t llua_call(llua_t *o, int nargs, int nresults);
 double *llua_tonumarray(lua_State* L, int idx);
 int *llua_tointarray(lua_State* L, int idx);
 char** llua_tostrarray(lua_State* L, int idx);
+err_t llua_toarray_buf(lua_State *L, int idx, char kind, void *buf, int size, int *len);
+void *llua_toarray(lua_State *L, int idx, char kind);
+void *llua_view_scope(lua_State *L);
 err_t llua_convert(lua_State *L, char kind, void *P, int idx);
 void *llua_callf(llua_t *o, const char *fmt,...);
+// NULL if every row succeeded, else a `char**` of row errors, or an error
+// if the columns are wrong: tell these apart with value_is_error
+void *llua_batch(llua_t *fn, const char *args, const char *rets,...);
+void *llua_batch_chunks(llua_t *fn, int chunk, const char *args, const char *rets,...);
+llua_sig_t *llua_sig_new(llua_t *o, const char *args, const char *rets);
+void *llua_sig_call(llua_sig_t *s, ...);
+llua_sig_t *llua_prepare(lua_State *L, const char *expr, const char *params, const char *rets);
 err_t llua_pop_vars(lua_State *L, const char *fmt,...);
 const char *llua_tostring(llua_t *o);
 lua_Number llua_tonumber(llua_t *o);
@@ -71,10 +185,24 @@ void *llua_gets(llua_t *o, const char *key);
 err_t llua_gets_v(llua_t *o, const char *key,...);
 void *llua_geti(llua_t *o, int key);
 void *llua_rawgeti(llua_t* o, int key);
+err_t llua_gets_as(llua_t *o, const char *key, char kind, void *P);
+err_t llua_geti_as(llua_t *o, int key, char kind, void *P);
+llua_key_t *llua_key(lua_State *L, const char *name);
+void *llua_getk(llua_t *o, llua_key_t *key);
+err_t llua_getk_as(llua_t *o, llua_key_t *key, char kind, void *P);
+void llua_setk(llua_t *o, llua_key_t *key, void *value);
+llua_path_t *llua_path_new(lua_State *L, const char *path, bool memo);
+void *llua_path_get(llua_path_t *p, llua_t *root);
+err_t llua_path_get_as(llua_path_t *p, llua_t *root, char kind, void *P);
 void llua_push_object(lua_State *L, void *value);
 void llua_seti(llua_t *o, int key, void *value);
 void llua_sets(llua_t *o, const char *key, void *value);
 err_t llua_sets_v(llua_t *o, const char *key,...);
+llua_schema_t *llua_schema_new(lua_State *L, const llua_field_t *fields);
+err_t llua_schema_fill(llua_schema_t *s, llua_t *o, void *dest);
+err_t llua_schema_write(llua_schema_t *s, llua_t *o, const void *src);
 void *llua_eval(lua_State *L, const char *expr, const char *fret);
 void *llua_evalfile(lua_State *L, const char *file, const char *fret, llua_t *env);
+void llua_cache_chunks(lua_State *L, int capacity);
+int llua_cache_stats(lua_State *L, int *hits, int *misses);
 #endif
@@ -4,12 +4,12 @@
     
     Just to make things more interesting, the environment has a metatable
     which turns unknown symbols into tables, so that 'A.B = 42' is
-    equivalent to 'A={B=42}'. llua_gets* can do two-level lookup,
+    equivalent to 'A={B=42}'. Schema fields can do two-level lookup,
     so the key 'A.B' works as expected.
     
-    There are two reference leaks in this program; we throw away
+    There are a few reference leaks in this program; we throw away
     the reference to the C function, and won't clean up the environment
-    if we blow up.  Not a major problem for this once-off task.
+    or the schema if we blow up.  Not a major problem for this once-off task.
 */
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,6 +23,16 @@ typedef struct {
     int a_b;
 } Config;
 
+// how the config table maps onto the struct; '?' means use existing value as default!
+static llua_field_t config_fields[] = {
+    LLUA_FIELD(Config,alpha,"i"),
+    LLUA_FIELD(Config,beta,"f"),
+    LLUA_FIELD(Config,address,"?s"),
+    LLUA_FIELD(Config,ports,"I"), // big 'I' means 'array of int'
+    {"A.B","i",offsetof(Config,a_b)},
+    {NULL}
+};
+
 const char *meta = 
     "return setmetatable({},{ "
     " __index = function(t,k) local v = {}; rawset(t,k,v); return v end"
@@ -38,14 +48,10 @@ int parse_config (lua_State *L) {
     llua_set_error(env,true);   // <--- any op on 'env' will raise an error, not just return it
     llua_evalfile(L,"config.txt","",env);
 
-     llua_gets_v(env,
-        "alpha","i",&c->alpha,
-        "beta","f",&c->beta,
-        "address","?s",&c->address, // ? means use existing value as default!
-        "ports","I",&c->ports, // big 'I' means 'array of int'
-        "A.B","i", &c->a_b,
-    NULL);
+    llua_schema_t *schema = llua_schema_new(L,config_fields);
+    llua_schema_fill(schema,env,c);
     
+    unref(schema);
     unref(env); // don't need it any more...
 
     // alternatively, can create the Config pointer in main and pass as lightuserdata ('p')
@@ -1,6 +1,25 @@
 #include <stdio.h>
 #include "llua.h"
 
+typedef struct {
+    int alpha;
+    double beta;
+    char *address;
+    int *ports;
+    char *author_name, *author_email;
+} Config;
+
+// how the config table maps onto the struct; '?' means use existing value as default!
+static llua_field_t config_fields[] = {
+    LLUA_FIELD(Config,alpha,"i"),
+    LLUA_FIELD(Config,beta,"f"),
+    LLUA_FIELD(Config,address,"?s"),
+    LLUA_FIELD(Config,ports,"I"), // big 'I' means 'array of int'
+    {"author.name","s",offsetof(Config,author_name)},
+    {"author.email","s",offsetof(Config,author_email)},
+    {NULL}
+};
+
 int main (int argc, char **argv)
 {
     lua_State *L = luaL_newstate();
@@ -15,33 +34,23 @@ int main (int argc, char **argv)
     }
     
     // we can now read values from the config
-    int alpha;
-    double beta;
-    char *address = "127.0.0.1";
-    int *ports;
-    char *author_name, *author_email;
-    
-     err = llua_gets_v(env,
-        "alpha","i",&alpha,
-        "beta","f",&beta,
-        "address","?s",&address, // ? means use existing value as default!
-        "ports","I",&ports, // big 'I' means 'array of int'
-        "author.name","s",&author_name,
-        "author.email","s",&author_email,
-    NULL);
+    Config c;
+    c.address = "127.0.0.1";
+    llua_schema_t *schema = llua_schema_new(L,config_fields);
+    err = llua_schema_fill(schema,env,&c);
     if (err) { // required field not specified?
         fprintf(stderr,"config field: %s\n",err);
         return 1;
     }
     
     printf("got alpha=%d beta=%f address='%s' name='%s' email='%s'\n",
-        alpha, beta, address, author_name, author_email
+        c.alpha, c.beta, c.address, c.author_name, c.author_email
     );
     
     // note how you get the size of the returned array
     printf("ports ");
-    for (int i = 0; i < array_len(ports); i++)
-        printf("%d ",ports[i]);
+    for (int i = 0; i < array_len(c.ports); i++)
+        printf("%d ",c.ports[i]);
     printf("\n");
     
     lua_close(L);
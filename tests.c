@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
@@ -13,6 +14,23 @@ int l_test(lua_State *L) {
     return 1;
 }
 
+// records what tasks are waiting for, and what they return
+static char sched_log[256];
+
+static void on_wait(llua_sched_t *S, llua_task_t task, const char *reason, lua_State *co, int nargs) {
+    char buff[64];
+    snprintf(buff,sizeof(buff),"%s:%s;",reason,nargs > 0 ? lua_tostring(co,-1) : "");
+    strcat(sched_log,buff);
+    if (strcmp(reason,"now") == 0) // a reason we can satisfy straight away
+        llua_sched_resume(S,task,"s","ok");
+}
+
+// two kinds of 'Thing', told apart by how they are disposed
+typedef struct { int n; } Thing;
+static int things_disposed;
+static void thing_dispose(Thing *t) { ++things_disposed; }
+static void thing_dispose2(Thing *t) { things_disposed += 10; }
+
 int main (int argc, char **argv)
 {
     lua_State *L = luaL_newstate();
@@ -55,5 +73,439 @@ int main (int argc, char **argv)
     assert(array_len(C) == n);   
     unref(C); // we own the string - clean it up
 
+    //////// prepared call signatures
+    int i1, i2;
+    double fres;
+    llua_sig_t *find = llua_sig_new(strfind,"ssi","ii");
+    assert(! llua_sig_call(find,"hello dolly","doll",1,&i1,&i2));
+    assert(i1 == 7 && i2 == 10);
+    // specifiers are checked up front
+    assert(value_is_error(llua_sig_new(strfind,"sz","ii")));
+    unref(find);
+    // all the ways of returning results
+    llua_t *pair = llua_eval(L,"return function(x,s) if x then return x*2,s end return nil,s end",L_VAL);
+    llua_sig_t *sf = llua_sig_new(pair,"fs","fs"), *sv = llua_sig_new(pair,"fs",L_VAL);
+    llua_sig_t *se = llua_sig_new(pair,"vs",L_ERR), *sm = llua_sig_new(str,"m","ri");
+    char *sres;
+    assert(! llua_sig_call(sf,1.5,"x",&fres,&sres) && fres == 3.0 && strcmp(sres,"x") == 0);
+    unref(sres);
+    double *dres = llua_sig_call(sv,2.0,"y");
+    assert(*dres == 4.0);
+    lua_pushnil(L);
+    char *eres = llua_sig_call(se,-1,"failed");
+    assert(value_is_error(eres) && strcmp(eres,"failed") == 0);
+    lua_pop(L,1);
+    unref(eres);
+    assert(llua_sig_call(sm,"len") == (void*)11);
+    dispose(pair,sf,sv,se,sm);
+    // prepared expressions are signatures too
+    llua_sig_t *expr = llua_prepare(L,"x*y + z","x:f,y:f,z:f","f");
+    assert(! llua_sig_call(expr,1.5,2.0,1.0,&fres) && fres == 4.0);
+    assert(value_is_error(llua_prepare(L,"x","x:z","f")));
+    unref(expr);
+
+    //////// scalars without boxing; common boxed values are shared
+    llua_t *T = llua_eval(L,"return {width=2.5,ok=true,n=10}",L_VAL);
+    double width;
+    bool ok;
+    assert(! llua_gets_as(T,"width",'f',&width) && width == 2.5);
+    assert(! llua_gets_as(T,"ok",'b',&ok) && ok);
+    assert(llua_gets(T,"n") == value_float(10));
+    assert(llua_gets(T,"ok") == value_bool(true));
+    unref(T);
+
+    //////// string views are valid for their scope
+    llua_view_t view;
+    void *scope = llua_view_scope(L);
+    assert(! llua_callf(strfind,"ss","hello dolly","(d%a+)","iiV",&i1,&i2,&view));
+    assert(view.len == 5 && strncmp(view.str,"dolly",5) == 0);
+    unref(scope);
+
+    //////// strings into caller buffers, with truncation an error
+    char small[4];
+    llua_buf_t sbuf = LLUA_BUF(small);
+    lua_pushstring(L,"ab");
+    lua_pushstring(L,"abcd");
+    assert(llua_convert(L,'B',&sbuf,-1) && sbuf.len == 4);
+    assert(! llua_convert(L,'B',&sbuf,-2) && strcmp(small,"ab") == 0);
+    lua_pop(L,2);
+
+    //////// bulk conversion to C arrays
+    float fv[4];
+    int nv;
+    T = llua_eval(L,"return {1,2,3.5}",L_REF);
+    llua_push(T);
+    assert(! llua_toarray_buf(L,-1,'g',fv,4,&nv) && nv == 3 && fv[2] == 3.5f);
+    void *aerr = llua_toarray(L,-1,'l'); // 3.5 is not an integer
+    assert(value_is_error(aerr));
+    lua_pop(L,1);
+    unref(aerr);
+    unref(T);
+
+    //////// interned keys
+    llua_key_t *kwidth = llua_key(L,"width");
+    T = llua_newtable(L);
+    llua_setk(T,kwidth,value_float(1.5));
+    assert(! llua_getk_as(T,kwidth,'f',&width) && width == 1.5);
+    unref(T);
+    unref(kwidth);
+
+    //////// compiled paths
+    int port;
+    T = llua_eval(L,"return {server={ports={80,443}}}",L_VAL);
+    llua_path_t *ppath = llua_path_new(L,"server.ports[2]",false);
+    assert(! llua_path_get_as(ppath,T,'i',&port) && port == 443);
+    unref(ppath);
+    ppath = llua_path_new(L,"server.tls.port",false);
+    assert(value_is_error(llua_path_get(ppath,T))); // 'server.tls' is nil
+    unref(ppath);
+    assert(value_is_error(llua_path_new(L,"server..port",false)));
+    unref(T);
+
+    //////// struct schemas fill and write back
+    typedef struct { int n; double x; bool ok; } Rec;
+    llua_field_t rec_fields[] = {
+        LLUA_FIELD(Rec,n,"i"),
+        {"pos.x","f",offsetof(Rec,x)},
+        LLUA_FIELD(Rec,ok,"?b"),
+        {NULL}
+    };
+    llua_schema_t *rec = llua_schema_new(L,rec_fields);
+    Rec r1 = {1,2.5,true}, r2 = {0,0,false};
+    T = llua_newtable(L);
+    assert(! llua_schema_write(rec,T,&r1));
+    assert(! llua_schema_fill(rec,T,&r2));
+    assert(r2.n == 1 && r2.x == 2.5 && r2.ok);
+    unref(T);
+    // anything else is an error rather than a Lua panic
+    lua_pushinteger(L,42);
+    T = llua_new(L,-1);
+    lua_pop(L,1);
+    err_t rerr = llua_schema_fill(rec,T,&r2);
+    assert(rerr && strcmp(rerr,"cannot fill from number") == 0);
+    unref(rerr);
+    rerr = llua_schema_write(rec,T,&r1);
+    assert(rerr && strcmp(rerr,"cannot write to number") == 0);
+    unref(rerr);
+    unref(T);
+    unref(rec);
+
+    //////// compiled chunks can be cached
+    int hits, misses;
+    llua_cache_chunks(L,8);
+    FOR(i,3) {
+        double *d = llua_eval(L,"return 0.5*3",L_VAL);
+        assert(*d == 1.5);
+    }
+    assert(llua_cache_stats(L,&hits,&misses) == 1 && hits == 2 && misses == 1);
+    llua_cache_chunks(L,0);
+
+    //////// handles: stale handles are caught, slots are reused
+    llua_handles_t *hs = llua_handles_new(L);
+    llua_handle_t h1, h2, hh[200];
+    lua_pushinteger(L,10);
+    h1 = llua_handle_new(hs,-1);
+    lua_pop(L,1);
+    assert(llua_handle_push(hs,h1) && lua_tointeger(L,-1) == 10);
+    lua_pop(L,1);
+    assert(llua_handle_free(hs,h1) && ! llua_handle_free(hs,h1));
+    lua_pushstring(L,"hello");
+    h2 = llua_handle_new(hs,-1);
+    lua_pop(L,1);
+    assert(h2 != h1 && ! llua_handle_push(hs,h1));
+    FOR(i,200) {
+        lua_pushinteger(L,i);
+        hh[i] = llua_handle_new(hs,-1);
+        lua_pop(L,1);
+    }
+    FOR(i,200)
+        llua_handle_free(hs,hh[i]);
+    assert(llua_handles_count(hs) == 1);
+    // the slots were dropped when the table shrank; old handles stay stale when they come back
+    llua_handle_t hold = hh[150];
+    FOR(i,200) {
+        lua_pushinteger(L,i);
+        hh[i] = llua_handle_new(hs,-1);
+        lua_pop(L,1);
+    }
+    assert(! llua_handle_push(hs,hold) && llua_handles_count(hs) == 201);
+    FOR(i,200)
+        llua_handle_free(hs,hh[i]);
+    T = llua_handle_get(hs,h2);
+    assert(strcmp(llua_tostring(T),"hello") == 0);
+    unref(T);
+    unref(hs);
+
+    //////// borrowed references to stack slots
+    T = llua_eval(L,"return {{x=1},{x=2},{x=3}}",L_VAL);
+    llua_t *sumf = llua_eval(L,"return function(t,acc) return acc + t.x end",L_VAL);
+    int sum = 0, top = lua_gettop(L);
+    FOR_TABLE(T) {
+        llua_scope_t *S = llua_scope_begin(L);
+        llua_t *item = llua_borrow(S,L_TVAL);
+        assert(llua_is_lua_object(item) && item->type == LUA_TTABLE);
+        int acc;
+        double *x = llua_gets(item,"x");
+        assert(! llua_callf(sumf,"oi",item,sum,"i",&acc));
+        sum = acc + (int)*x;
+        unref(x);
+        unref(item); // does nothing
+        llua_scope_end(S);
+    }
+    lua_pop(L,1); // FOR_TABLE leaves the table
+    assert(lua_gettop(L) == top && sum == 12);
+    unref(sumf);
+    unref(T);
+    // a signature keeps its own reference; borrowing takes no registry slot
+    llua_stats_t bst1, bst2;
+    llua_scope_t *BS = llua_scope_begin(L);
+    lua_pushcfunction(L,l_test);
+    llua_stats(L,&bst1);
+    llua_sig_t *bsig = llua_sig_new(llua_borrow(BS,-1),"s","s");
+    llua_scope_end(BS);
+    BS = llua_scope_begin(L);
+    lua_pushinteger(L,42);
+    llua_borrow(BS,-1); // the recycled reference
+    llua_stats(L,&bst2);
+    assert(bst2.refs_created == bst1.refs_created + 1);
+    char *bsres;
+    assert(! llua_sig_call(bsig,"hello",&bsres) && strcmp(bsres,"Hello") == 0);
+    llua_scope_end(BS);
+    unref(bsres);
+    unref(bsig);
+
+    //////// coroutine tasks sleep on the timer wheel, or wait for C
+    llua_sched_t *sched = llua_sched_new(L,10,on_wait,NULL);
+    llua_t *task_fn = llua_eval(L,
+        "return function(name)\n"
+        "  coroutine.yield('sleep',25)\n"
+        "  local line = coroutine.yield('read',name)\n"
+        "  return line .. coroutine.yield('now','x')\n"
+        "end",L_VAL);
+    llua_task_t task = llua_sched_spawn(sched,task_fn,"s","in");
+    assert(task && llua_sched_count(sched) == 1 && ! llua_sched_resume(sched,task,""));
+    assert(llua_sched_run(sched,1000) == 0 && llua_sched_run(sched,1020) == 0);
+    assert(llua_sched_run(sched,1030) == 1 && strcmp(sched_log,"read:in;") == 0);
+    assert(llua_sched_resume(sched,task,"s","hello "));
+    assert(strcmp(sched_log,"read:in;now:x;done:hello ok;") == 0);
+    assert(llua_sched_count(sched) == 0 && ! llua_sched_resume(sched,task,""));
+    // a long sleep skips whole turns of the wheel, and wakes on time
+    llua_t *long_fn = llua_eval(L,"return function() coroutine.yield('sleep',100000) end",L_VAL);
+    assert(llua_sched_spawn(sched,long_fn,""));
+    assert(llua_sched_run(sched,101020) == 0 && llua_sched_run(sched,101030) == 1);
+    assert(llua_sched_count(sched) == 0 && llua_sched_run(sched,5000000) == 0);
+    unref(long_fn);
+    // the thread is reused for the next task
+    *sched_log = '\0';
+    llua_task_t task2 = llua_sched_spawn(sched,task_fn,"s","again");
+    assert(task2 != task && (task2 & 0xFFFF) == (task & 0xFFFF));
+    unref(task_fn);
+    unref(sched);
+
+    //////// batch calls over columns, with errors per row
+    double *bx = array_new(double,4), *by = array_new(double,4);
+    char **bnames = array_new_ref(char*,4), **bres = array_new_ref(char*,4), **berrs;
+    FOR(i,4) {
+        bx[i] = i;
+        bnames[i] = str_new("n");
+    }
+    llua_t *score = llua_eval(L,
+        "return function(x,name) if x == 2 then error('two!',0) end return 10*x, name..('%d'):format(x) end",L_VAL);
+    berrs = llua_batch(score,"fs","fs",bx,bnames,by,bres);
+    assert(berrs && ! value_is_error(berrs) && berrs[0] == NULL && strcmp(berrs[2],"two!") == 0);
+    assert(by[3] == 30 && strcmp(bres[1],"n1") == 0 && bres[2] == NULL);
+    unref(berrs);
+    unref(score);
+    // new strings replace the old ones; a result of the wrong type fails its row
+    score = llua_eval(L,"return function(x,name) return x == 1 and 'one' or x, name end",L_VAL);
+    berrs = llua_batch(score,"fs","fs",bx,bnames,by,bres);
+    assert(berrs && strcmp(berrs[1],"result 1: not a number!") == 0 && berrs[2] == NULL);
+    assert(by[2] == 2 && strcmp(bres[2],"n") == 0);
+    unref(berrs);
+    unref(score);
+    score = llua_eval(L,
+        "return function(xs) local r = {} for i,x in ipairs(xs) do r[i] = x + 1 end return r end",L_VAL);
+    assert(llua_batch_chunks(score,3,"f","f",bx,by) == NULL && by[3] == 4);
+    unref(score);
+    unref(bx); unref(by); unref(bnames); unref(bres);
+
+    //////// iterating over a table in batches
+    T = llua_eval(L,"return {10,20,nil,40,a=1,b=2,c=3}",L_VAL);
+    llua_iter_t *it = llua_iter_new(T,"oi");
+    void *ikeys[4];
+    int ivals[4], got, total = 0, nkeys = 0;
+    while ((got = llua_iter_next(it,4,ikeys,ivals)) > 0) {
+        FOR(i,got) {
+            total += ivals[i];
+            unref(ikeys[i]);
+        }
+        nkeys += got;
+    }
+    assert(got == 0 && nkeys == 6 && total == 76);
+    unref(it);
+    unref(T);
+    T = llua_eval(L,"return {1.5,2.5,'x'}",L_VAL);
+    it = llua_iter_new(T,"if");
+    int ikeys2[4];
+    double fvals[4];
+    assert(llua_iter_next(it,4,ikeys2,fvals) == 2 && ikeys2[1] == 2 && fvals[1] == 2.5);
+    assert(llua_iter_next(it,4,ikeys2,fvals) == -1);
+    assert(strcmp(llua_iter_error(it),"not a number!") == 0);
+    unref(it);
+    unref(T);
+    // the object value is released when its key can't be converted
+    ObjTypeCounts lc1, lc2;
+    T = llua_eval(L,"return {a={}}",L_VAL);
+    it = llua_iter_new(T,"fo");
+    obj_type_counts(OBJ_LLUA_T,&lc1);
+    assert(llua_iter_next(it,4,fvals,ikeys) == -1);
+    obj_type_counts(OBJ_LLUA_T,&lc2);
+    assert(lc2.created - lc2.freed == lc1.created - lc1.freed);
+    unref(it);
+    unref(T);
+    // the table is rehashed between calls, so the last key has gone
+    T = llua_eval(L,"return {a=1,b=2,c=3}",L_VAL);
+    it = llua_iter_new(T,"si");
+    char *skeys[4];
+    assert(llua_iter_next(it,1,skeys,ivals) == 1);
+    unref(skeys[0]);
+    llua_t *rehash = llua_eval(L,"return function(t) for k in pairs(t) do t[k] = nil end "
+        "for i = 1,100 do t['k'..i] = i end end",L_VAL);
+    assert(llua_callf(rehash,"o",T,"") == NULL);
+    assert(llua_iter_next(it,4,skeys,ivals) == -1);
+    assert(strcmp(llua_iter_error(it),"table changed during iteration") == 0);
+    unref(rehash);
+    unref(it);
+    unref(T);
+
+    //////// statistics
+    llua_stats_t st1, st2;
+    llua_t *bad = llua_eval(L,"return function() error('bad') end",L_VAL);
+    llua_stats(L,&st1);
+    void *berr = llua_callf(bad,"",L_NONE);
+    assert(value_is_error(berr));
+    unref(berr);
+    unref(bad);
+    llua_stats(L,&st2);
+    assert(st2.calls == st1.calls + 1 && st2.call_errors == st1.call_errors + 1);
+    assert(st2.refs_freed > st1.refs_freed && st2.objects_created > st1.objects_created);
+    FILE *prom = tmpfile();
+    char line[256];
+    const char *metric = "llib_type_objects_live{type=\"llua_t\"}";
+    long long live = -1;
+    ObjTypeCounts tcounts;
+    llua_stats_dump(L,prom);
+    obj_type_counts(OBJ_LLUA_T,&tcounts);
+    rewind(prom);
+    while (fgets(line,sizeof(line),prom))
+        if (strncmp(line,metric,strlen(metric)) == 0)
+            live = atoll(line + strlen(metric));
+    fclose(prom);
+    assert(live > 0 && live == tcounts.created - tcounts.freed);
+
+    //////// call latency histograms
+    llua_profile_t prof;
+    llua_t *chunk = llua_load(L,"\n\nreturn function(n) local s = 0 for i = 1,n do s = s + i end return s end","slow");
+    llua_t *slow = llua_callf(chunk,"",L_VAL);  // (this call isn't timed)
+    unref(chunk);
+    llua_profile(true);
+    FOR(i,100)
+        llua_callf(slow,"i",i*100,L_NONE);
+    llua_profile(false);
+    assert(llua_profile_get(slow,&prof) && prof.count == 100);
+    assert(prof.p50 <= prof.p99 && prof.p99 <= prof.max && prof.mean <= prof.max);
+    assert(strcmp(prof.label,"[string \"slow\"]:3") == 0);
+    assert(llua_profile_report(&prof,1) == 1);
+    llua_profile_reset();
+    assert(! llua_profile_get(slow,&prof) && llua_profile_report(&prof,1) == 0);
+    unref(slow);
+    // a new function never inherits the histogram of a collected one at the same address
+    llua_profile(true);
+    FOR(i,50) {
+        llua_t *fresh = llua_eval(L,"return function() end",L_VAL);
+        llua_callf(fresh,"",L_NONE);
+        assert(llua_profile_get(fresh,&prof) && prof.count == 1);
+        unref(fresh);
+        lua_gc(L,LUA_GCCOLLECT,0);
+    }
+    llua_profile(false);
+    // collected functions (and the chunks which made them) are reported until a reset
+    assert(llua_profile_report(&prof,1) == 100);
+    llua_profile_reset();
+    assert(llua_profile_report(&prof,1) == 0);
+
+    //////// llib types, pools and arenas
+    llua_t *t1 = llua_newtable(L);
+    assert(obj_is_instance(t1,"llua_t") && llua_is_lua_object(t1));
+    assert(! obj_is_instance(t1,"char"));
+    Thing *th1 = obj_new(Thing,thing_dispose), *th2 = obj_new(Thing,thing_dispose2);
+    assert(obj_is_instance(th1,"Thing") && obj_is_instance(th2,"Thing") && obj_type_index(th1) != obj_type_index(th2));
+    unref(th1);
+    unref(th2);
+    assert(things_disposed == 11);
+    ObjSlabStats slab1, slab2;
+    obj_slab_stats(&slab1);
+    llua_t *t2 = llua_newtable(L);  // references come from the slab allocator
+    obj_slab_stats(&slab2);
+    assert(slab2.allocs == slab1.allocs + 1 && slab2.in_use > slab1.in_use);
+    unref(t2);
+
+    int kount = obj_kount();
+    void *P = obj_pool();
+    char *s1 = str_new("one"), *s2 = str_new("two");
+    str_new("three");
+    assert(obj_pool_count(P) == 3);
+    unref(s1);
+    assert(obj_pool_count(P) == 2);
+    ref(s2);
+    unref(P);
+    assert(obj_refcount(s2) == 1 && obj_kount() == kount + 1);
+    unref(s2);
+    assert(obj_kount() == kount);
+
+    char *shared = obj_share(str_new("shared"));
+    ref(shared);
+    unref(shared);
+    assert(obj_refcount(shared) == 1);
+    unref(shared);
+
+    P = obj_pool_arena();
+    s1 = str_new("arena");
+    char **strs = array_new_ref(char*,2);
+    strs[0] = str_new("kept");
+    strs[1] = str_new("too");
+    char *kept = obj_keep(s1);
+    char **kstrs = obj_keep(strs);
+    llua_t *kt = obj_keep(llua_newtable(L));
+    llua_sig_t *ksig = obj_keep(llua_sig_new(strfind,"ss","i"));
+    llua_path_t *kpath = obj_keep(llua_path_new(L,"string.format",true));
+    unref(llua_path_get(kpath,NULL));  // memoized in the arena's scope
+    assert(obj_refcount(kept) == 1 && kept != s1);
+    unref(P);
+    assert(strcmp(kept,"arena") == 0 && strcmp(kstrs[0],"kept") == 0 && strcmp(kstrs[1],"too") == 0);
+    assert(llua_sig_call(ksig,"hello","lo",&i1) == NULL && i1 == 4);
+    llua_t *fmt = llua_path_get(kpath,NULL);
+    assert(llua_is_lua_object(fmt) && fmt->type == LUA_TFUNCTION);
+    llua_sets(kt,"x",fmt);
+    dispose(kept,kstrs,kt,ksig,kpath,fmt);
+    assert(obj_kount() == kount);
+    // shared boxes are never arena objects, even when first made in one
+    P = obj_pool_arena();
+    void *b1000 = value_int(1000), *bfalse = value_bool(false);
+    unref(P);
+    assert(value_int(1000) == b1000 && value_as_int(b1000) == 1000);
+    assert(value_bool(false) == bfalse && ! value_as_bool(bfalse));
+    // as are cached chunks
+    llua_cache_chunks(L,4);
+    P = obj_pool_arena();
+    assert(*(double*)llua_eval(L,"return 2^9",L_VAL) == 512);
+    unref(P);
+    P = obj_pool();
+    assert(*(double*)llua_eval(L,"return 2^9",L_VAL) == 512);
+    unref(P);
+    assert(*(double*)llua_eval(L,"return 2^9",L_VAL) == 512);
+    assert(llua_cache_stats(L,&hits,&misses) == 1 && hits == 2 && misses == 1);
+    llua_cache_chunks(L,0);
+
     lua_close(L);
 }